@@ -6,6 +6,13 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #define BLOCK_SIZE	512
 #define INODE_SIZE	32
@@ -14,9 +21,22 @@
 #define INODE_ALLOC	0x8000		//indicate this i-node is allocated
 #define IS_DIR		0x4000		//indicate associated file is directory
 #define IS_LARGE	0x1000		//indicate associated file is a large file
+#define IS_COMPRESSED	0x0800		//file data is stored as compressed chunks
+#define IS_INLINE	0x0400		//file data is kept in addr[] of the i-node
+#define INODE_PENDING	0x0200		//handed out by get_free_inode, not written yet
 
 #define ROOT_INUM	1		//I-node 1 is reserved for the root directory
 
+#define ADDR_PER_BLOCK	(BLOCK_SIZE / sizeof(unsigned short))	//256 entries per indirect block
+#define MAX_FILE_BLOCKS	(7 * ADDR_PER_BLOCK)	//a large file has up to 7 indirect blocks
+#define DIR_ENTRY_MAX	(8 * BLOCK_SIZE / 16)	//directory files are small files
+
+#define INLINE_MAX	16		//files this small are kept in the i-node
+#define COMPRESS_CHUNK	16384		//bytes of input compressed independently
+#define COMPRESS_MAX_SIZE	(1 << 24)	//largest file cpin compresses
+#define MAX_WORKERS	16
+#define SNAP_MAX	16		//snapshots kept in one image
+
 static int initialized = 0;
 static int block_num = 0;		//total number of blocks in the disk
 static int inode_num = 0;		//total number of i-nodes in the disk
@@ -24,7 +44,12 @@ static unsigned short nfree = 0;
 static unsigned short free_array[100];
 static unsigned short ninode;
 static unsigned short inode[100];
-static int cur_dir_inum = 1;		//i-number represent current directory
+static unsigned short tfree;		//free blocks in the whole free list
+static unsigned short tinode;		//free i-nodes in the whole i-list
+static unsigned int nfreed;		//blocks freed so far, dedup_lookup checks it
+static __thread int cur_dir_inum = 1;	//i-number represent current directory
+static __thread FILE *out_fp;		//command output, stdout or a client of the server
+static __thread FILE *err_fp;
 //static char cur_path[128];
 //static unsigned short inode_flags = 0;
 
@@ -39,6 +64,13 @@ struct super_block {
 	char ilock;
 	char fmod;
 	unsigned short time[2];
+	unsigned short dedup_inum;	//i-node holding block reference counts and dedup index
+	char dedup;			//share identical blocks on cpin
+	char compress;			//compress files on cpin
+	char usage;			//tfree, tinode and directory totals are kept
+	unsigned short tfree;
+	unsigned short tinode;
+	unsigned short snap_inum;	//i-node holding the snapshot table
 } sp_blk;
 
 /* i-nodes are 32 bytes long */
@@ -54,16 +86,193 @@ struct inode {
 	unsigned short modtime[2];
 };
 
+/*
+ * a directory keeps the totals of its subtree, itself included, in place of
+ * its otherwise unused time fields
+ */
+struct dir_usage {
+	unsigned int blocks;		//data, indirect and directory blocks
+	unsigned int inodes;
+};
+#define USAGE_OFFSET	offsetof(struct inode, actime)
+
 /* directory entries are 16 bytes long */
 struct dir_entry {
 	unsigned short i_num;		//first word is i-number of the file
 	char name[14];			//bytes 2-15 represent the file name
 };
 
+/*
+ * a compressed file starts with this header, followed by the chunk table
+ * (nchunks + 1 offsets into the file, chunk k is stored between offset k and
+ * k + 1) and the chunks themselves. a chunk that did not get smaller is
+ * stored as it is
+ */
+struct compress_header {
+	unsigned int size;		//uncompressed file size
+	unsigned int chunk_size;	//bytes of input per chunk
+	unsigned int nchunks;
+};
+
+/* dedup index slots map the hash of a block's contents to the block */
+struct dedup_slot {
+	unsigned int hash;
+	unsigned short blk;		//0 for an empty slot
+	unsigned short pad;
+};
+
+/*
+ * dedup table, kept in the hidden file sp_blk.dedup_inum: one reference count
+ * byte per block followed by the hash index. a count of 0 means the block is
+ * not shared (or not allocated at all), an index slot whose block has a count
+ * of 0 is stale and may be reused. snapshots keep their references to blocks
+ * in the same counts. a count that reaches 255 sticks, such a block is never
+ * freed
+ */
+static char *dedup_table;
+static unsigned int dedup_table_size;
+static unsigned char *blk_ref;
+static struct dedup_slot *dedup_index;
+static int dedup_slots;
+static unsigned char *dedup_dirty;	//one byte per block of the dedup table
+
+/*
+ * a snapshot is a frozen copy of the i-list. ilist[k] is the block holding the
+ * snapshot's copy of i-list block k, or 0 while block k has not changed since
+ * the snapshot was taken. block k is copied out the first time the live tree
+ * writes it, and the blocks named by the copied i-nodes take a reference for
+ * the copy. the table is kept in the hidden file sp_blk.snap_inum
+ */
+struct snapshot {
+	char name[14];
+	unsigned short state;		//SNAP_FREE, SNAP_OK or SNAP_DAMAGED
+	unsigned int time;
+	unsigned short ilist[];		//one entry per block of the i-list
+};
+#define SNAP_FREE	0
+#define SNAP_OK		1
+#define SNAP_DAMAGED	2		//an i-list block could not be copied out
+
+/*
+ * an archive is a header followed by records: one AR_INODE record per file
+ * with its i-node and the numbers of its data blocks in file order (0 for a
+ * hole), AR_END_INODES, then AR_DATA records carrying runs of those blocks in
+ * ascending block order, and AR_END. block numbers are the ones of the image
+ * the archive was made from
+ */
+struct archive_header {
+	char magic[4];			//"V6AR"
+	unsigned short version;
+	unsigned short isize;
+	unsigned int block_num;
+	unsigned int inode_num;
+	char dedup;
+	char compress;
+	char pad[2];
+};
+
+struct archive_rec {
+	unsigned short type;
+	unsigned short inum;		//AR_INODE: i-number
+	unsigned short start;		//AR_DATA: first block of the run
+	unsigned short count;		//blocks listed or carried
+};
+#define AR_INODE	1		//followed by the i-node and count block numbers
+#define AR_END_INODES	2
+#define AR_DATA		3		//followed by count blocks of data
+#define AR_END		4
+#define AR_RUN_MAX	64		//blocks per AR_DATA record and per write
+
+/* a file or directory still to be looked at by find or grep */
+struct search_task {
+	int inum;
+	char *path;
+};
+
+/* the tasks of one worker, it takes from the tail and others steal the head */
+struct task_deque {
+	pthread_mutex_t lock;
+	struct search_task *tasks;
+	int head, count, cap;
+};
+
+struct search_hit {
+	char *path;
+	unsigned int line;		//grep only
+	char *text;			//the line printed
+};
+
+struct search_job {
+	int fs_fd;
+	struct task_deque deques[MAX_WORKERS];
+	int nworkers;
+	int next_id;
+	pthread_mutex_t wait_lock;	//covers pending and queued
+	pthread_cond_t wait_cond;	//a task was queued or the last one finished
+	int pending;			//tasks queued or being worked on
+	int queued;			//tasks in the deques
+	int grep;
+	const char *name;		//find -name pattern, or NULL
+	int size_cmp;			//find -size: -1 less, 0 equal, 1 more, 2 not given
+	unsigned int size;
+	unsigned int size_unit;
+	const char *pattern;		//grep pattern
+	int pattern_len;
+	pthread_mutex_t lock;		//covers the hits
+	struct search_hit *hits;
+	int nhits, hits_cap;
+	int failed;
+};
+
+/* where grep is in a file */
+struct grep_scan {
+	struct inode *nd;
+	unsigned short *data;		//blocks of the file
+	unsigned int size;		//bytes in the file
+	char *buf;
+	unsigned int buf_pos;		//file offset of buf[0]
+	int total;			//bytes in buf
+	unsigned int line;		//line number at the search position
+	unsigned int line_pos;		//file offset that line starts at
+};
+#define GREP_CHUNK	65536		//bytes of a file searched at a time
+#define GREP_LINE_MAX	160		//longest line printed by grep
+
+static char *snap_table;
+static int snap_rec_size;
+static int snap_dirty;
+static int nsnap;			//snapshots in state SNAP_OK
+static unsigned char *ilist_shared;	//block k of the i-list is still shared
+static int snap_gen;			//bumped by rollback
+static __thread int cwd_gen;
+static int rm_gen;			//bumped by removing a directory
+static __thread int cwd_rm_gen;
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int snap_cow_inode(int fs_fd, int inum);
+static void discard_file(int fs_fd, int inum);
+static void release_block(int fs_fd, int b);
+
+/*
+ * commands that work on the whole image (initfs, defrag, dedup, compress) hold
+ * fs_lock exclusively, all others share it. alloc_lock covers the free block
+ * list, the free i-node array and the dedup table. a command locks the
+ * i-nodes it reads or changes, always a directory before the files in it.
+ * usage_lock covers the subtree totals of all directories, they are changed
+ * up the tree from a directory whose lock is held. snap_lock covers copying
+ * i-list blocks out to the snapshots. the locks are taken in the order
+ * usage_lock, snap_lock, alloc_lock
+ */
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t usage_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t *inode_locks;
+static int inode_locks_num;
+
 
 static void print_usage(void)
 {
-	printf("\n[v6 file system] following commands supported:\n"
+	fprintf(out_fp, "\n[v6 file system] following commands supported:\n"
 		"=======================================================\n"
 		"initfs block_num inode_num	//Initialize file system\n"
 		"cpin externalfile v6-file	//copy external file into v6 fs\n"
@@ -71,8 +280,27 @@ static void print_usage(void)
 		"cpout v6-file externalfile	//copy v6 file out to external file system\n"
 		"mkdir v6-dir			//create v6-dir in current directory of v6 fs\n"
 		"cd v6-dir			//access v6-dir in current directory of v6 fs\n"
-		"rm v6-file			//delete v6-file if exists\n"
+		"rm [-r] v6-file			//delete v6-file if exists, -r deletes a\n"
+		"				  directory and everything below it\n"
 		"ls				//list all files exist in current directory\n"
+		"du [v6-file|v6-dir]		//blocks and i-nodes used by a file or a\n"
+		"				  directory tree, the current directory by default\n"
+		"df				//free and used blocks and i-nodes\n"
+		"defrag [v6-file|v6-dir]		//move files into contiguous blocks, whole fs\n"
+		"				  if no file or directory is given\n"
+		"dedup on|off			//share identical blocks between files on cpin\n"
+		"compress on|off			//compress files copied in by cpin\n"
+		"snapshot name			//freeze the current tree as snapshot name\n"
+		"snapshot list			//list snapshots\n"
+		"snapshot delete name		//delete snapshot name\n"
+		"rollback name			//bring the tree back to snapshot name\n"
+		"find [path] [-name pattern] [-size [+-]n[ck]]\n"
+		"				//list files below path matching the pattern\n"
+		"				  and size, n in 512 byte blocks by default\n"
+		"grep pattern [path]		//print lines of files below path holding\n"
+		"				  pattern\n"
+		"export-archive externalfile	//write all files to an archive\n"
+		"import-archive externalfile	//replace the whole fs with an archive\n"
 		"q				//save chagnes and quit\n"
 		"\n");
 }
@@ -89,46 +317,77 @@ static void update_super_block(int fs_fd)
 {
 #if 0
 	int i;
-	printf("nfree = %d, ninode = %d\n", nfree, ninode);
+	fprintf(out_fp, "nfree = %d, ninode = %d\n", nfree, ninode);
 	for (i = 0; i < nfree; i++)
-		printf("%d ", free_array[i]);
-	printf("\n");
+		fprintf(out_fp, "%d ", free_array[i]);
+	fprintf(out_fp, "\n");
 	for (i = 0; i < 100; i++)
-		printf("%d ", inode[i]);
-	printf("\n");
+		fprintf(out_fp, "%d ", inode[i]);
+	fprintf(out_fp, "\n");
 #endif
 
+	pthread_mutex_lock(&alloc_lock);
 	sp_blk.nfree = nfree;
 	sp_blk.ninode = ninode;
 	memcpy(sp_blk.free, free_array, 100 * sizeof(unsigned short));
 	memcpy(sp_blk.inode, inode, 100 * sizeof(unsigned short));
-
-	lseek(fs_fd, 1 * BLOCK_SIZE, SEEK_SET);
-	write(fs_fd, &sp_blk, sizeof(sp_blk));
+	sp_blk.tfree = tfree;
+	sp_blk.tinode = tinode;
+	pwrite(fs_fd, &sp_blk, sizeof(sp_blk), 1 * BLOCK_SIZE);	//q may run in several sessions
+	pthread_mutex_unlock(&alloc_lock);
 }
 
 static void read_super_block(int fs_fd)
 {
-	lseek(fs_fd, 1 * BLOCK_SIZE, SEEK_SET);
-	read(fs_fd, &sp_blk, sizeof(sp_blk));
+	pread(fs_fd, &sp_blk, sizeof(sp_blk), 1 * BLOCK_SIZE);
 
 	nfree = sp_blk.nfree;
 	ninode = sp_blk.ninode;
 	memcpy(free_array, sp_blk.free, 100 * sizeof(unsigned short));
 	memcpy(inode, sp_blk.inode, 100 * sizeof(unsigned short));
+	tfree = sp_blk.tfree;
+	tinode = sp_blk.tinode;
+
+	/* recover the geometry of an existing file system */
+	if (sp_blk.isize != 0) {
+		inode_num = sp_blk.isize * 16;
+		block_num = sp_blk.fsize;
+		if (block_num == 0) {		//image made before fsize was kept
+			struct stat st;
+			fstat(fs_fd, &st);
+			block_num = st.st_size / BLOCK_SIZE;
+		}
+	}
 
 #if 0
 	int i;
-	printf("nfree = %d, ninode = %d\n", nfree, ninode);
+	fprintf(out_fp, "nfree = %d, ninode = %d\n", nfree, ninode);
 	for (i = 0; i < nfree; i++)
-		printf("%d ", free_array[i]);
-	printf("\n");
+		fprintf(out_fp, "%d ", free_array[i]);
+	fprintf(out_fp, "\n");
 	for (i = 0; i < 100; i++)
-		printf("%d ", inode[i]);
-	printf("\n");
+		fprintf(out_fp, "%d ", inode[i]);
+	fprintf(out_fp, "\n");
 #endif
 }
 
+/*
+ * copy nfree and the free array into block b with a single write and set
+ * nfree to 0, b then heads the free block chain. the caller holds alloc_lock
+ */
+static void spill_free_list(int fs_fd, int b)
+{
+	char buf[BLOCK_SIZE];
+
+	//fprintf(out_fp, "b = %d, sizeof(nfree)=%d, sizeof(free)=%d\n",
+	//	b, sizeof(nfree), sizeof(free_array));
+	memset(buf, 0, BLOCK_SIZE);
+	memcpy(buf, &nfree, sizeof(nfree));
+	memcpy(buf + sizeof(nfree), free_array, sizeof(free_array));
+	pwrite(fs_fd, buf, BLOCK_SIZE, b * BLOCK_SIZE);
+	nfree = 0;
+}
+
 /*
  * add free block b into the free block list: set free_array[nfree] to the freed
  * block's number and increment nfree.(if nfree is 100, first copy nfree and the
@@ -136,16 +395,14 @@ static void read_super_block(int fs_fd)
  */
 static void add_free_block(int fs_fd, int b)
 {
-	if (nfree == 100) {
-		lseek(fs_fd, b * BLOCK_SIZE, SEEK_SET);
-		//printf("b = %d, sizeof(nfree)=%d, sizeof(free)=%d\n",
-		//	b, sizeof(nfree), sizeof(free_array));
-		write(fs_fd, &nfree, sizeof(nfree));
-		write(fs_fd, free_array, sizeof(free_array));
-		nfree = 0;
-	}
+	pthread_mutex_lock(&alloc_lock);
+	if (nfree == 100)
+		spill_free_list(fs_fd, b);
 
 	free_array[nfree++] = b;
+	tfree++;
+	nfreed++;
+	pthread_mutex_unlock(&alloc_lock);
 }
 
 /*
@@ -158,20 +415,24 @@ static int get_free_block(int fs_fd)
 {
 	int new_blk;
 
+	pthread_mutex_lock(&alloc_lock);
 	nfree--;
 	new_blk = free_array[nfree];
 
 	/* if the new block number is 0, there are no blocks left */
 	if (new_blk == 0) {
-		fprintf(stderr, "Error: No blocks left!\n");
+		nfree++;				//keep the end of list marker
+		pthread_mutex_unlock(&alloc_lock);
+		fprintf(err_fp, "Error: No blocks left!\n");
 		return -1;
 	}
 
 	if (nfree == 0) {
-		lseek(fs_fd, new_blk * BLOCK_SIZE, SEEK_SET);
-		read(fs_fd, &nfree, sizeof(nfree));
-		read(fs_fd, free_array, sizeof(free_array));
+		pread(fs_fd, &nfree, sizeof(nfree), new_blk * BLOCK_SIZE);
+		pread(fs_fd, free_array, sizeof(free_array), new_blk * BLOCK_SIZE + sizeof(nfree));
 	}
+	tfree--;
+	pthread_mutex_unlock(&alloc_lock);
 
 	return new_blk;
 }
@@ -185,574 +446,3712 @@ static void reload_inode_array(int fs_fd)
 	int count = 0;
 	struct inode nd;
 
-	lseek(fs_fd, 2 * BLOCK_SIZE + 1 * INODE_SIZE, SEEK_SET);
 	for (i = 2; i <= inode_num && count < 100; i++) {
-		read(fs_fd, &nd, sizeof(nd));
+		pread(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (i-1) * INODE_SIZE);
 		if ((nd.flags & INODE_ALLOC) == 0)
 			inode[count++] = i;
 	}
 	ninode = count;
 }
 
-/* allocate an i-node and return the inode number */
+/*
+ * allocate an i-node and return the inode number. the i-node is marked
+ * allocated on disk right away so that a reload of the inode array by another
+ * command can't hand it out again before its owner writes it. this placeholder
+ * goes straight into the i-list, a snapshot copy of its block drops it again.
+ * INODE_PENDING tells it from an empty file, every real i-node write drops it
+ */
 static int get_free_inode(int fs_fd)
 {
-	if (ninode > 0)
-		return inode[--ninode];
-	else if (ninode == 0) {
+	struct inode nd;
+	int inum = -1;
+
+	pthread_mutex_lock(&alloc_lock);
+	if (ninode == 0)
 		reload_inode_array(fs_fd);
-		return get_free_inode(fs_fd);
-	} else {
-		fprintf(stderr, "No free inode could be allocated!\n");
-		return -1;
+	if (ninode > 0) {
+		inum = inode[--ninode];
+		tinode--;
+		memset(&nd, 0, sizeof(nd));
+		nd.flags = INODE_ALLOC | INODE_PENDING;
+		pwrite(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE);
 	}
+	pthread_mutex_unlock(&alloc_lock);
+
+	if (inum < 0)
+		fprintf(err_fp, "No free inode could be allocated!\n");
+	return inum;
 }
 
 /* free I-node i and add it to the free inode array if ninode is less than 100 */
 static void free_inode(int fs_fd, int i)
 {
 	struct inode nd;
+	snap_cow_inode(fs_fd, i);
 	memset(&nd, 0, sizeof(nd));
-	lseek(fs_fd, 2 * BLOCK_SIZE + (i-1) * INODE_SIZE, SEEK_SET);
-	write(fs_fd, &nd, sizeof(nd));
+	pwrite(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (i-1) * INODE_SIZE);
 
+	pthread_mutex_lock(&alloc_lock);
 	if (ninode < 100)
 		inode[ninode++] = i;
+	tinode++;
+	pthread_mutex_unlock(&alloc_lock);
 }
 
-/* find the file in v6 file system and return its associated i-node number */
-static int locate_file(int fs_fd, char *file_name)
-{	
-	struct inode nd;
-	struct dir_entry entry;
-	int inum, blk_idx;
-	int i, j;
+static int cmp_inum(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
 
-	inum = cur_dir_inum;
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
+/*
+ * free a batch of i-nodes: they are sorted so that each block of the i-list
+ * is read and written once, however many of its i-nodes go
+ */
+static void free_inode_batch(int fs_fd, int *inums, int n)
+{
+	char buf[BLOCK_SIZE];
+	int i, j, blk;
 
-	for (i = 0; i < (nd.size1 / BLOCK_SIZE); i++) {
-		blk_idx = nd.addr[i];
-		lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-		for (j = 0; j < BLOCK_SIZE / sizeof(entry); j++) {
-			read(fs_fd, &entry, sizeof(entry));
-			if (strcmp(entry.name, file_name) == 0)
-				return entry.i_num;
-		}
-	}
-	if ((nd.size1 % BLOCK_SIZE) != 0) {
-		blk_idx = nd.addr[i];
-		lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-		for (j = 0; j < (nd.size1 % BLOCK_SIZE) / sizeof(entry); j++) {
-			read(fs_fd, &entry, sizeof(entry));
-			if (strcmp(entry.name, file_name) == 0)
-				return entry.i_num;
-		}
+	qsort(inums, n, sizeof(int), cmp_inum);
+	for (i = 0; i < n; i = j) {
+		blk = 2 + (inums[i] - 1) / 16;
+		snap_cow_inode(fs_fd, inums[i]);
+		pread(fs_fd, buf, BLOCK_SIZE, blk * BLOCK_SIZE);
+		for (j = i; j < n && 2 + (inums[j] - 1) / 16 == blk; j++)
+			memset(buf + ((inums[j] - 1) % 16) * INODE_SIZE, 0, INODE_SIZE);
+		pwrite(fs_fd, buf, BLOCK_SIZE, blk * BLOCK_SIZE);
 	}
 
-	return -1;				//file not found, return -1
+	pthread_mutex_lock(&alloc_lock);
+	for (i = 0; i < n && ninode < 100; i++)
+		inode[ninode++] = inums[i];
+	tinode += n;
+	pthread_mutex_unlock(&alloc_lock);
 }
 
-//static void add_dir_entry(struct dir_entry *entry) {}
-
-/*
- * Initialize the V6 file system, there are block_num blocks and inode_num
- * inodes in the disk. The first block is left unused. The second block is used
- * as super block. I-nodes reside in the third and subsequent blocks
- */
-static int init_v6fs(int fs_fd)
+static void init_inode_locks(void)
 {
-	unsigned int fs_size;
 	int i;
-	int cur_blk;
-	int inode_block_num;
-
-	if (initialized) {
-		printf("v6 file system has been initialized already\n");
-		return -1;
-	}
 
-	fs_size = BLOCK_SIZE * block_num;
-	if (ftruncate(fs_fd, fs_size) < 0) {
-		printf("Error: failed on setting the size of file system!\n");
-		return -1;
-	}
+	for (i = 0; i < inode_locks_num; i++)
+		pthread_rwlock_destroy(&inode_locks[i]);
+	free(inode_locks);
+	inode_locks_num = 0;
 
-	inode_block_num = (inode_num + 15) / 16;	//16 i-nodes fit into a block
-	cur_blk = 2 + inode_block_num;
-	free_array[nfree++] = 0;			//initially set free_array[0] to 0
+	inode_locks = malloc((inode_num + 1) * sizeof(pthread_rwlock_t));
+	if (inode_locks == NULL)
+		return;
+	for (i = 0; i <= inode_num; i++)
+		pthread_rwlock_init(&inode_locks[i], NULL);
+	inode_locks_num = inode_num + 1;
+}
 
-	/* set all data blocks to free */
-	for (; cur_blk < block_num; cur_blk++)
-		add_free_block(fs_fd, cur_blk);
+static void lock_inode(int inum, int exclusive)
+{
+	if (inum <= 0 || inum >= inode_locks_num)
+		return;
+	if (exclusive)
+		pthread_rwlock_wrlock(&inode_locks[inum]);
+	else
+		pthread_rwlock_rdlock(&inode_locks[inum]);
+}
 
-	/* initialize all i-nodes data to 0 */
-	lseek(fs_fd, 2 * BLOCK_SIZE, SEEK_SET);	
-	char buf[INODE_SIZE] = {0};
-	for (i = 0; i < inode_num; i++)
-		write(fs_fd, buf, INODE_SIZE);
+static void unlock_inode(int inum)
+{
+	if (inum > 0 && inum < inode_locks_num)
+		pthread_rwlock_unlock(&inode_locks[inum]);
+}
 
-	/*
-	 * initialize the root directory, i-node 1 is associated with root
-	 * directory. Add the first two entries "." and ".." to root directory,
-	 * where ".." has the same meaning as "."
-	 */
-	struct dir_entry entry1, entry2;
-	entry1.i_num = ROOT_INUM;
-	strcpy(entry1.name, ".");
-	entry2.i_num = ROOT_INUM;
-	strcpy(entry2.name, "..");
+/* "." and ".." lead up the tree, they must not be locked below their parent */
+static int is_dot_name(char *name)
+{
+	return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
 
-	cur_blk = get_free_block(fs_fd);
-	lseek(fs_fd, cur_blk * BLOCK_SIZE, SEEK_SET);
-	write(fs_fd, &entry1, sizeof(entry1));
-	write(fs_fd, &entry2, sizeof(entry2));
-	
-	/* fill in contents of i-node 1 */
-	struct inode nd;
-	memset(&nd, 0, sizeof(nd));
-	nd.flags = nd.flags | INODE_ALLOC | IS_DIR;
-	//printf("nd.flags = 0x%x\n", nd.flags);
-	nd.size1 = 2 * sizeof(entry1);
-	nd.addr[0] = cur_blk;
-	lseek(fs_fd, 2 * BLOCK_SIZE, SEEK_SET);
-	write(fs_fd, &nd, sizeof(nd));
+static void read_inode(int fs_fd, int inum, struct inode *nd)
+{
+	pread(fs_fd, nd, sizeof(*nd), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE);
+}
 
-	/* initialize ninode and inode array */
-	if ((inode_num - 1) < 100)
-		ninode = inode_num - 1;
-	else
-		ninode = 100;
-	for (i = 0; i < ninode; i++)
-		inode[i] = 2 + i;			//free i-numbers start from 2
+static void write_inode(int fs_fd, int inum, struct inode *nd)
+{
+	snap_cow_inode(fs_fd, inum);
+	nd->flags &= ~INODE_PENDING;		//no longer a placeholder
+	pwrite(fs_fd, nd, sizeof(*nd), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE);
+}
 
-	/* initialize the super block */
-	sp_blk.isize = inode_block_num;
-	update_super_block(fs_fd);
-	//read_super_block(fs_fd);
+static unsigned int inode_file_size(struct inode *nd)
+{
+	return (unsigned char)nd->size0 * (1 << 16) + nd->size1;
+}
 
-	initialized = 1;
-	cur_dir_inum = ROOT_INUM;
+static void set_dir_usage(struct inode *nd, unsigned int blocks, unsigned int inodes)
+{
+	struct dir_usage u;
 
-	return 0;
+	u.blocks = blocks;
+	u.inodes = inodes;
+	memcpy((char *)nd + USAGE_OFFSET, &u, sizeof(u));
 }
 
+static void get_dir_usage(struct inode *nd, struct dir_usage *u)
+{
+	memcpy(u, (char *)nd + USAGE_OFFSET, sizeof(*u));
+}
 
-static void cpin(int fs_fd, char *ext_file, char *v6_file)
+/*
+ * collect the block numbers of a file: data[] receives the data blocks in
+ * file order and ind[] the indirect blocks of a large file (*nind of them).
+ * a block number of 0 is a hole. return the number of data blocks
+ */
+static int get_file_blocks(int fs_fd, struct inode *nd, unsigned short *data,
+			   unsigned short *ind, int *nind)
 {
-	FILE *ext;
-	unsigned int file_size;
-	int req_blk_num;
-	int i, blk_idx, inum;
-	char buf[BLOCK_SIZE];
-	struct inode nd;
-	struct dir_entry entry;
+	int total_block, i, n;
 
-	ext = fopen(ext_file, "r");
-	if (ext == NULL) {
-		fprintf(stderr, "open file %s failed!\n", ext_file);
-		return;
+	total_block = (inode_file_size(nd) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	*nind = 0;
+	if (nd->flags & IS_INLINE)			//no block at all
+		return 0;
+	if ((nd->flags & IS_LARGE) == 0) {		//small file
+		for (i = 0; i < total_block && i < 8; i++)
+			data[i] = nd->addr[i];
+		return i;
 	}
 
-	inum = get_free_inode(fs_fd);
-	if (inum < 0)
-		return;
-	memset(&nd, 0, sizeof(nd));
-	nd.flags |= INODE_ALLOC;
-
-	fseek(ext, 0, SEEK_END);
-	file_size = ftell(ext);
-	nd.size0 = file_size >> 16;
-	nd.size1 = (unsigned short)file_size;
-	//printf("nd.size0 = %d, nd.size1 = %d\n", nd.size0, nd.size1);
-	req_blk_num = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	if (req_blk_num <= 8) {				//small file
-		fseek(ext, 0, SEEK_SET);
-		for (i = 0; i < req_blk_num; i++) {
-			fread(buf, 1, BLOCK_SIZE, ext);
-			blk_idx = get_free_block(fs_fd);
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			write(fs_fd, buf, BLOCK_SIZE);
-			nd.addr[i] = blk_idx;
-		}
-	} else {					//large file
-		unsigned short indirect_block_data[256];
-		int j;
-
-		fseek(ext, 0, SEEK_SET);
-		for (i = 0; i < req_blk_num / 256 && i < 7; i++) {
-			blk_idx = get_free_block(fs_fd);
-			nd.addr[i] = blk_idx;
-
-			for (j = 0; j < 256; j++) {
-				fread(buf, 1, BLOCK_SIZE, ext);
-				blk_idx = get_free_block(fs_fd);
-				indirect_block_data[j] = blk_idx;
-				lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-				write(fs_fd, buf, BLOCK_SIZE);
-			}
-
-			lseek(fs_fd, nd.addr[i] * BLOCK_SIZE, SEEK_SET);
-			write(fs_fd, indirect_block_data, BLOCK_SIZE);
-		}
-		if (i == 7) {
-			fprintf(stderr, "super large file, not supported!\n");
-			return;
-		}
-		if ((req_blk_num % 256) != 0) {
-			blk_idx = get_free_block(fs_fd);
-			nd.addr[i] = blk_idx;
-			for (j = 0; j < (req_blk_num % 256); j++) {
-				fread(buf, 1, BLOCK_SIZE, ext);
-				blk_idx = get_free_block(fs_fd);
-				indirect_block_data[j] = blk_idx;
-				lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-				write(fs_fd, buf, BLOCK_SIZE);
-			}
-			lseek(fs_fd, nd.addr[i] * BLOCK_SIZE, SEEK_SET);
-			write(fs_fd, indirect_block_data, (req_blk_num % 256) * 2);
+	if (total_block > MAX_FILE_BLOCKS)
+		total_block = MAX_FILE_BLOCKS;
+	for (i = 0; i * ADDR_PER_BLOCK < total_block; i++) {
+		n = total_block - i * ADDR_PER_BLOCK;
+		if (n > ADDR_PER_BLOCK)
+			n = ADDR_PER_BLOCK;
+		ind[i] = nd->addr[i];
+		if (ind[i] == 0) {			//hole of a whole indirect block
+			memset(&data[i * ADDR_PER_BLOCK], 0, n * sizeof(unsigned short));
+			continue;
 		}
+		pread(fs_fd, &data[i * ADDR_PER_BLOCK], n * sizeof(unsigned short), ind[i] * BLOCK_SIZE);
+	}
+	*nind = i;
+	return total_block;
+}
+
+/*
+ * point file nd at the n data blocks in data[] (0 for a hole), allocating and
+ * writing the indirect blocks if it has to be a large file. an indirect block
+ * that would only hold holes is left out as well. return -1 if no block left,
+ * the indirect blocks allocated so far are freed again
+ */
+static int set_file_blocks(int fs_fd, struct inode *nd, unsigned short *data, int n)
+{
+	unsigned short indirect_block_data[ADDR_PER_BLOCK];
+	int i, j, blk_idx, hole;
 
-		nd.flags |= IS_LARGE;
+	memset(nd->addr, 0, sizeof(nd->addr));
+	if (n <= 8) {					//small file
+		nd->flags &= ~IS_LARGE;
+		for (i = 0; i < n; i++)
+			nd->addr[i] = data[i];
+		return 0;
 	}
 
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	write(fs_fd, &nd, sizeof(nd));
+	nd->flags |= IS_LARGE;
+	for (i = 0; i * ADDR_PER_BLOCK < n; i++) {
+		memset(indirect_block_data, 0, sizeof(indirect_block_data));
+		hole = 1;
+		for (j = 0; j < ADDR_PER_BLOCK && i * ADDR_PER_BLOCK + j < n; j++) {
+			indirect_block_data[j] = data[i * ADDR_PER_BLOCK + j];
+			if (indirect_block_data[j] != 0)
+				hole = 0;
+		}
+		if (hole)
+			continue;
 
-	/* create corresponding directory entry */
-	entry.i_num = inum;
-	strcpy(entry.name, v6_file);
-	//printf("entry.i_num is %d, entry.name is %s\n", entry.i_num, entry.name);
-	lseek(fs_fd, 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
-	int entry_idx, block_idx;
-	/* Let's suppose directory file is small file */
-	if (nd.size1 % BLOCK_SIZE == 0) {
-		block_idx = get_free_block(fs_fd);
-		entry_idx = 0;
-		nd.addr[nd.size1 / BLOCK_SIZE] = block_idx;
-	} else {
-		block_idx = nd.addr[nd.size1 / BLOCK_SIZE];
-		entry_idx = (nd.size1 % BLOCK_SIZE) / sizeof(entry);
+		blk_idx = get_free_block(fs_fd);
+		if (blk_idx < 0) {
+			while (i-- > 0)
+				if (nd->addr[i] != 0)
+					add_free_block(fs_fd, nd->addr[i]);
+			memset(nd->addr, 0, sizeof(nd->addr));
+			return -1;
+		}
+		nd->addr[i] = blk_idx;
+		pwrite(fs_fd, indirect_block_data, BLOCK_SIZE, blk_idx * BLOCK_SIZE);
 	}
-	//printf("block_idx = %d, entry_idx = %d\n", block_idx, entry_idx);
-	lseek(fs_fd, block_idx * BLOCK_SIZE + entry_idx * sizeof(entry), SEEK_SET);
-	write(fs_fd, &entry, sizeof(entry));
+	return 0;
+}
 
-	/* update contents of i-node representing current directory */
-	nd.size1 += sizeof(entry);
-	lseek(fs_fd, 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE, SEEK_SET);
-	write(fs_fd, &nd, sizeof(nd));
+/* check whether a block holds nothing but zero bytes */
+static int is_zero_block(const char *buf)
+{
+	return buf[0] == 0 && memcmp(buf, buf + 1, BLOCK_SIZE - 1) == 0;
+}
 
-	printf("cpin command successfully executed, totally %d bytes copied\n", file_size);
-	fclose(ext);
-	return;
+/* lay out the dedup table in memory for the current block_num */
+static void dedup_table_geometry(void)
+{
+	unsigned int ref_size;
+
+	ref_size = (block_num + 7) & ~7;
+	for (dedup_slots = 64; dedup_slots < block_num; dedup_slots <<= 1) ;
+	dedup_table_size = ref_size + dedup_slots * sizeof(struct dedup_slot);
 }
 
-static void cpout(int fs_fd, char *v6_file, char *ext_file)
+/* set up the in-memory dedup table from the hidden file, if there is one */
+static void load_dedup_table(int fs_fd)
 {
-	FILE *ext;
-	unsigned int file_size;
-	int i, blk_idx, inum;
-	char buf[BLOCK_SIZE];
 	struct inode nd;
-	//struct dir_entry entry;
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	int i, n, nind, nblk;
 
-	inum = locate_file(fs_fd, v6_file);
-	//printf("cpout: the inum retrurned is %d\n", inum);
-	if (inum < 0) {
-		fprintf(stderr, "file %s does not exist in v6 file system, please check!\n", v6_file);
-		return;
-	}
-	ext = fopen(ext_file, "w");
-	if (ext == NULL) {
-		fprintf(stderr, "open file %s failed!\n", ext_file);
+	if (sp_blk.dedup_inum == 0 || block_num == 0)
 		return;
-	}
 
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
-	file_size = nd.size0 * (1 << 16) + nd.size1;
-	//printf("nd.size0 = %d, nd.size1 = %d, file_size = %d\n", nd.size0, nd.size1, file_size);
-	if ((nd.flags & IS_LARGE) == 0) {		//small file
-		for (i = 0; i < (file_size / BLOCK_SIZE); i++) {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, buf, BLOCK_SIZE);
-			fwrite(buf, 1, BLOCK_SIZE, ext);
-		}
-		if ((file_size % BLOCK_SIZE) != 0) {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, buf, file_size % BLOCK_SIZE);
-			fwrite(buf, 1, file_size % BLOCK_SIZE, ext);
-		}
-	} else {
-		int total_block, j;
-		unsigned short indirect_block_data[256];
-		total_block = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-		for (i = 0; i < (total_block - 1) / 256; i++) {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, indirect_block_data, BLOCK_SIZE);
-			for (j = 0; j < 256; j++) {
-				blk_idx = indirect_block_data[j];
-				lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-				read(fs_fd, buf, BLOCK_SIZE);
-				fwrite(buf, 1, BLOCK_SIZE, ext);
-			}
-		}
-		if ((total_block - 1) % 256 != 0) {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, indirect_block_data, BLOCK_SIZE);
-			for (j = 0; j < (total_block - 1) % 256; j++) {
-				blk_idx = indirect_block_data[j];
-				lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-				read(fs_fd, buf, BLOCK_SIZE);
-				fwrite(buf, 1, BLOCK_SIZE, ext);
-			}
-			blk_idx = indirect_block_data[j];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, buf, file_size % BLOCK_SIZE);
-			fwrite(buf, 1, file_size % BLOCK_SIZE, ext);
-		} else {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, buf, file_size % BLOCK_SIZE);
-			fwrite(buf, 1, file_size % BLOCK_SIZE, ext);
-		}
+	dedup_table_geometry();
+	nblk = (dedup_table_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	dedup_table = calloc(nblk, BLOCK_SIZE);
+	dedup_dirty = calloc(nblk, 1);
+	if (dedup_table == NULL || dedup_dirty == NULL) {
+		fprintf(err_fp, "Error: no memory for the dedup table!\n");
+		exit(EXIT_FAILURE);
 	}
+	blk_ref = (unsigned char *)dedup_table;
+	dedup_index = (struct dedup_slot *)(dedup_table + dedup_table_size -
+			dedup_slots * sizeof(struct dedup_slot));
 
-	printf("cpout command successfully executed, %d bytes written to file %s\n",
-		file_size, ext_file);
-	fclose(ext);
-	return;
+	read_inode(fs_fd, sp_blk.dedup_inum, &nd);
+	n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+	for (i = 0; i < n && i < nblk; i++) {
+		pread(fs_fd, dedup_table + i * BLOCK_SIZE, BLOCK_SIZE, data[i] * BLOCK_SIZE);
+	}
 }
 
-static void make_dir(int fs_fd, char *v6_dir)
+/* write the blocks of the dedup table that changed back to the hidden file */
+static void save_dedup_table(int fs_fd)
 {
-	int inum, blk_idx;
 	struct inode nd;
-	struct dir_entry entry, entry1, entry2;
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	int i, n, nind;
 
-	if (locate_file(fs_fd, v6_dir) != -1) {
-		printf("file with same name exists in current directory, "
-			"please rename the directory file\n");
+	if (dedup_table == NULL)
 		return;
+
+	read_inode(fs_fd, sp_blk.dedup_inum, &nd);
+	n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+	pthread_mutex_lock(&alloc_lock);
+	for (i = 0; i < n; i++) {
+		if (!dedup_dirty[i])
+			continue;
+		pwrite(fs_fd, dedup_table + i * BLOCK_SIZE, BLOCK_SIZE, data[i] * BLOCK_SIZE);
+		dedup_dirty[i] = 0;
 	}
+	pthread_mutex_unlock(&alloc_lock);
+}
 
-	inum = get_free_inode(fs_fd);
-	entry1.i_num = inum;
-	strcpy(entry1.name, ".");
-	entry2.i_num = cur_dir_inum;
-	strcpy(entry2.name, "..");
+/*
+ * create a hidden file of size bytes, zero filled and not linked into any
+ * directory. return its i-number or -1
+ */
+static int create_hidden_file(int fs_fd, unsigned int size)
+{
+	struct inode nd;
+	unsigned short data[MAX_FILE_BLOCKS];
+	char buf[BLOCK_SIZE];
+	int i, n, inum, blk_idx;
 
-	blk_idx = get_free_block(fs_fd);
-	lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-	write(fs_fd, &entry1, sizeof(entry1));
-	write(fs_fd, &entry2, sizeof(entry2));
+	n = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (n > MAX_FILE_BLOCKS)
+		return -1;
+
+	inum = get_free_inode(fs_fd);
+	if (inum < 0)
+		return -1;
+	memset(buf, 0, BLOCK_SIZE);
+	for (i = 0; i < n; i++) {
+		blk_idx = get_free_block(fs_fd);
+		if (blk_idx < 0)
+			break;
+		pwrite(fs_fd, buf, BLOCK_SIZE, blk_idx * BLOCK_SIZE);
+		data[i] = blk_idx;
+	}
 
 	memset(&nd, 0, sizeof(nd));
-	nd.flags = INODE_ALLOC | IS_DIR;
-	nd.size1 = 2 * sizeof(entry1);
-	nd.addr[0] = blk_idx;
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	write(fs_fd, &nd, sizeof(nd));
+	nd.flags = INODE_ALLOC;
+	nd.size0 = size >> 16;
+	nd.size1 = (unsigned short)size;
+	if (i < n || set_file_blocks(fs_fd, &nd, data, n) < 0) {
+		while (i-- > 0)
+			add_free_block(fs_fd, data[i]);
+		free_inode(fs_fd, inum);
+		return -1;
+	}
+	write_inode(fs_fd, inum, &nd);
+	return inum;
+}
+
+/* create the hidden file holding the dedup table, all counts start at 0 */
+static int create_dedup_table(int fs_fd)
+{
+	int inum;
+
+	dedup_table_geometry();
+	inum = create_hidden_file(fs_fd, dedup_table_size);
+	if (inum < 0) {
+		fprintf(err_fp, "Error: no room for the dedup table!\n");
+		return -1;
+	}
+
+	sp_blk.dedup_inum = inum;
+	load_dedup_table(fs_fd);
+	return 0;
+}
+
+/* remember that the dedup table byte at offset has to be written back */
+static void dedup_touch(void *p)
+{
+	dedup_dirty[((char *)p - dedup_table) / BLOCK_SIZE] = 1;
+}
+
+static void set_blk_ref(int b, unsigned char ref)
+{
+	if (blk_ref == NULL || blk_ref[b] == ref)
+		return;
+	blk_ref[b] = ref;
+	dedup_touch(&blk_ref[b]);
+}
+
+static unsigned int block_hash(const char *buf)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL, w;
+	int i;
+
+	for (i = 0; i < BLOCK_SIZE; i += sizeof(w)) {
+		memcpy(&w, buf + i, sizeof(w));
+		h = (h ^ w) * 0x100000001b3ULL;
+	}
+	return (unsigned int)(h ^ (h >> 32));
+}
+
+/*
+ * whether block b holds the same contents as buf. it is read with alloc_lock
+ * dropped so that other commands can allocate and free meanwhile, the caller
+ * holds the lock before and after
+ */
+static int dedup_same(int fs_fd, const char *buf, int b)
+{
+	char blk_buf[BLOCK_SIZE];
+
+	pthread_mutex_unlock(&alloc_lock);
+	pread(fs_fd, blk_buf, BLOCK_SIZE, b * BLOCK_SIZE);
+	pthread_mutex_lock(&alloc_lock);
+	return memcmp(buf, blk_buf, BLOCK_SIZE) == 0;
+}
+
+/*
+ * look for a block with the same contents as buf. on a match its reference
+ * count is taken and the block number returned, otherwise return 0 and leave
+ * in *slot the index slot where the block written for buf should be recorded
+ * (NULL if the index is full). a candidate is compared without alloc_lock held,
+ * if any block was freed meanwhile it may have been handed out again with other
+ * contents, so it is compared once more after its reference is taken
+ */
+static int dedup_lookup(int fs_fd, const char *buf, unsigned int hash,
+			struct dedup_slot **slot)
+{
+	struct dedup_slot *s;
+	unsigned int freed;
+	int i, k, b, blk_idx = 0;
+
+	*slot = NULL;
+	pthread_mutex_lock(&alloc_lock);
+	k = hash & (dedup_slots - 1);
+	for (i = 0; i < dedup_slots; i++, k = (k + 1) & (dedup_slots - 1)) {
+		s = &dedup_index[k];
+		if (s->blk == 0 || blk_ref[s->blk] == 0) {
+			if (*slot == NULL)
+				*slot = s;
+			if (s->blk == 0)
+				break;
+			continue;
+		}
+		if (s->hash != hash || blk_ref[s->blk] == 255)
+			continue;
+
+		b = s->blk;
+		freed = nfreed;
+		if (!dedup_same(fs_fd, buf, b) || blk_ref[b] == 0 || blk_ref[b] == 255)
+			continue;
+		set_blk_ref(b, blk_ref[b] + 1);
+		if (nfreed != freed && !dedup_same(fs_fd, buf, b)) {
+			pthread_mutex_unlock(&alloc_lock);
+			release_block(fs_fd, b);
+			pthread_mutex_lock(&alloc_lock);
+			continue;
+		}
+		blk_idx = b;
+		break;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return blk_idx;
+}
+
+/*
+ * record block b holding the contents hashed to hash in an index slot, unless
+ * another command took the slot in the meantime
+ */
+static void dedup_insert(struct dedup_slot *slot, unsigned int hash, int b)
+{
+	if (slot == NULL)
+		return;
+	pthread_mutex_lock(&alloc_lock);
+	if (slot->blk == 0 || blk_ref[slot->blk] == 0) {
+		slot->hash = hash;
+		slot->blk = b;
+		dedup_touch(slot);
+		set_blk_ref(b, 1);
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/*
+ * drop a reference to block b, the block only goes back to the free list when
+ * no other file shares it any more
+ */
+static void release_block(int fs_fd, int b)
+{
+	pthread_mutex_lock(&alloc_lock);
+	if (blk_ref != NULL && blk_ref[b] > 1) {
+		if (blk_ref[b] < 255)
+			set_blk_ref(b, blk_ref[b] - 1);
+		pthread_mutex_unlock(&alloc_lock);
+		return;
+	}
+	set_blk_ref(b, 0);
+	pthread_mutex_unlock(&alloc_lock);
+	add_free_block(fs_fd, b);
+}
+
+static int cmp_blk_desc(const void *a, const void *b)
+{
+	return *(const unsigned short *)b - *(const unsigned short *)a;
+}
+
+/*
+ * drop a reference to each of n blocks in one go. the blocks that become free
+ * are added highest first, so they are handed out again in ascending order,
+ * and each spilled free chain block costs one write
+ */
+static void release_block_batch(int fs_fd, unsigned short *blocks, int n)
+{
+	int i;
+
+	qsort(blocks, n, sizeof(unsigned short), cmp_blk_desc);
+	pthread_mutex_lock(&alloc_lock);
+	for (i = 0; i < n; i++) {
+		if (blk_ref != NULL && blk_ref[blocks[i]] > 1) {
+			if (blk_ref[blocks[i]] < 255)
+				set_blk_ref(blocks[i], blk_ref[blocks[i]] - 1);
+			continue;
+		}
+		set_blk_ref(blocks[i], 0);
+		if (nfree == 100)
+			spill_free_list(fs_fd, blocks[i]);
+		free_array[nfree++] = blocks[i];
+		tfree++;
+		nfreed++;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+}
+
+/* take another reference to block b, the caller holds alloc_lock */
+static void take_block_ref(int b)
+{
+	if (blk_ref == NULL || blk_ref[b] == 255)
+		return;
+	set_blk_ref(b, blk_ref[b] ? blk_ref[b] + 1 : 2);
+}
+
+/* the dedup and snapshot tables belong to the image, not to any snapshot */
+static int is_hidden_inum(int inum)
+{
+	return inum == sp_blk.dedup_inum || inum == sp_blk.snap_inum;
+}
+
+/*
+ * a new copy of i-node nd references the blocks in its addr[] once more. the
+ * blocks below an indirect block are counted through the indirect block. the
+ * caller holds alloc_lock
+ */
+static void take_inode_refs(struct inode *nd)
+{
+	int i;
+
+	if ((nd->flags & INODE_ALLOC) == 0 || (nd->flags & IS_INLINE))
+		return;
+	for (i = 0; i < 8; i++)
+		if (nd->addr[i] != 0)
+			take_block_ref(nd->addr[i]);
+}
+
+/*
+ * drop the references a copy of i-node nd holds. an indirect block that is
+ * freed drops the references to its data blocks in turn
+ */
+static void drop_inode_refs(int fs_fd, struct inode *nd)
+{
+	unsigned short entries[ADDR_PER_BLOCK];
+	int i, j, b, shared;
+
+	if ((nd->flags & INODE_ALLOC) == 0 || (nd->flags & IS_INLINE))
+		return;
+	for (i = 0; i < 8; i++) {
+		if ((b = nd->addr[i]) == 0)
+			continue;
+		if ((nd->flags & IS_LARGE) == 0) {
+			release_block(fs_fd, b);
+			continue;
+		}
+		pthread_mutex_lock(&alloc_lock);
+		shared = blk_ref != NULL && blk_ref[b] > 1;
+		pthread_mutex_unlock(&alloc_lock);
+		if (!shared) {
+			pread(fs_fd, entries, BLOCK_SIZE, b * BLOCK_SIZE);
+			for (j = 0; j < ADDR_PER_BLOCK; j++)
+				if (entries[j] != 0)
+					release_block(fs_fd, entries[j]);
+		}
+		release_block(fs_fd, b);
+	}
+}
+
+/* an i-node get_free_inode handed out whose owner has not written it yet */
+static int is_placeholder(struct inode *nd)
+{
+	return (nd->flags & INODE_PENDING) != 0;
+}
+
+/* the records are padded so that every one of them is aligned like the first */
+static int snap_record_size(void)
+{
+	int size = sizeof(struct snapshot) + sp_blk.isize * sizeof(unsigned short);
+
+	return (size + __alignof__(struct snapshot) - 1) & ~(__alignof__(struct snapshot) - 1);
+}
+
+static struct snapshot *snap_rec(int i)
+{
+	return (struct snapshot *)(snap_table + i * snap_rec_size);
+}
+
+/* recount the usable snapshots and which i-list blocks they still share */
+static void update_ilist_shared(void)
+{
+	struct snapshot *snap;
+	int i, k;
+
+	nsnap = 0;
+	if (snap_table == NULL)
+		return;
+	memset(ilist_shared, 0, sp_blk.isize);
+	for (i = 0; i < SNAP_MAX; i++) {
+		snap = snap_rec(i);
+		if (snap->state != SNAP_OK)
+			continue;
+		nsnap++;
+		for (k = 0; k < sp_blk.isize; k++)
+			if (snap->ilist[k] == 0)
+				ilist_shared[k] = 1;
+	}
+}
+
+/*
+ * copy i-list block k out to a new block for every snapshot still sharing it,
+ * before the live tree changes it. the caller holds snap_lock
+ */
+static int snap_copy_out(int fs_fd, int k)
+{
+	struct inode nd[16];
+	struct snapshot *snap;
+	int i, j, inum, blk_idx;
+
+	blk_idx = get_free_block(fs_fd);
+	if (blk_idx < 0) {
+		for (i = 0; i < SNAP_MAX; i++) {
+			snap = snap_rec(i);
+			if (snap->state == SNAP_OK && snap->ilist[k] == 0) {
+				fprintf(err_fp, "Error: snapshot %s could not be kept\n", snap->name);
+				snap->state = SNAP_DAMAGED;
+			}
+		}
+		snap_dirty = 1;
+		update_ilist_shared();
+		return -1;
+	}
+
+	pread(fs_fd, nd, BLOCK_SIZE, (2 + k) * BLOCK_SIZE);
+	for (j = 0; j < 16; j++) {
+		inum = k * 16 + j + 1;
+		if (inum > inode_num || is_hidden_inum(inum) || is_placeholder(&nd[j]))
+			memset(&nd[j], 0, sizeof(nd[j]));
+	}
+	pwrite(fs_fd, nd, BLOCK_SIZE, blk_idx * BLOCK_SIZE);
+
+	pthread_mutex_lock(&alloc_lock);
+	for (j = 0; j < 16; j++)
+		take_inode_refs(&nd[j]);
+	pthread_mutex_unlock(&alloc_lock);
+
+	for (i = 0; i < SNAP_MAX; i++) {
+		snap = snap_rec(i);
+		if (snap->state == SNAP_OK && snap->ilist[k] == 0)
+			snap->ilist[k] = blk_idx;
+	}
+	snap_dirty = 1;
+	ilist_shared[k] = 0;
+	return 0;
+}
+
+/*
+ * called before i-node inum, or a block only reachable through it, is
+ * changed: copy its i-list block out if a snapshot still shares it
+ */
+static int snap_cow_inode(int fs_fd, int inum)
+{
+	int k, ret = 0;
+
+	if (nsnap == 0)
+		return 0;
+	k = (inum - 1) / 16;
+	pthread_mutex_lock(&snap_lock);
+	if (ilist_shared[k])
+		ret = snap_copy_out(fs_fd, k);
+	pthread_mutex_unlock(&snap_lock);
+	return ret;
+}
+
+/* whether i-node inum is still shared with a snapshot, blocks and all */
+static int snap_shared_inode(int inum)
+{
+	return nsnap > 0 && ilist_shared[(inum - 1) / 16];
+}
+
+/* set up the in-memory snapshot table from the hidden file, if there is one */
+static void load_snap_table(int fs_fd)
+{
+	struct inode nd;
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	int i, n, nind, nblk;
+
+	free(snap_table);
+	free(ilist_shared);
+	snap_table = NULL;
+	ilist_shared = NULL;
+	nsnap = 0;
+	if (sp_blk.snap_inum == 0)
+		return;
+
+	snap_rec_size = snap_record_size();
+	nblk = (SNAP_MAX * snap_rec_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	snap_table = calloc(nblk, BLOCK_SIZE);
+	ilist_shared = calloc(sp_blk.isize, 1);
+	if (snap_table == NULL || ilist_shared == NULL) {
+		fprintf(err_fp, "Error: no memory for the snapshot table!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	read_inode(fs_fd, sp_blk.snap_inum, &nd);
+	n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+	for (i = 0; i < n && i < nblk; i++)
+		pread(fs_fd, snap_table + i * BLOCK_SIZE, BLOCK_SIZE, data[i] * BLOCK_SIZE);
+	update_ilist_shared();
+}
+
+/* write the snapshot table back to the hidden file if it changed */
+static void save_snap_table(int fs_fd)
+{
+	struct inode nd;
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	int i, n, nind;
+
+	if (snap_table == NULL)
+		return;
+
+	pthread_mutex_lock(&snap_lock);
+	if (snap_dirty) {
+		read_inode(fs_fd, sp_blk.snap_inum, &nd);
+		n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+		for (i = 0; i < n; i++)
+			pwrite(fs_fd, snap_table + i * BLOCK_SIZE, BLOCK_SIZE, data[i] * BLOCK_SIZE);
+		snap_dirty = 0;
+	}
+	pthread_mutex_unlock(&snap_lock);
+}
+
+/* read all entries of directory file nd into entries[], return the number */
+static int read_dir(int fs_fd, struct inode *nd, struct dir_entry *entries)
+{
+	int i, n;
+
+	n = nd->size1 / sizeof(struct dir_entry);
+	if (n > DIR_ENTRY_MAX)
+		n = DIR_ENTRY_MAX;
+	for (i = 0; i * (BLOCK_SIZE / sizeof(struct dir_entry)) < n; i++) {
+		pread(fs_fd, &entries[i * (BLOCK_SIZE / sizeof(struct dir_entry))], BLOCK_SIZE, nd->addr[i] * BLOCK_SIZE);
+	}
+	return n;
+}
+
+/* i-number of file_name in directory dir_inum, or -1 */
+static int dir_lookup(int fs_fd, int dir_inum, char *file_name)
+{
+	struct inode nd;
+	struct dir_entry entries[DIR_ENTRY_MAX];
+	int i, n;
+
+	read_inode(fs_fd, dir_inum, &nd);
+	if ((nd.flags & IS_DIR) == 0)
+		return -1;
+	n = read_dir(fs_fd, &nd, entries);
+	for (i = 0; i < n; i++)
+		if (entries[i].i_num != 0 && strcmp(entries[i].name, file_name) == 0)
+			return entries[i].i_num;
+
+	return -1;				//file not found, return -1
+}
+
+/* find the file in v6 file system and return its associated i-node number */
+static int locate_file(int fs_fd, char *file_name)
+{
+	return dir_lookup(fs_fd, cur_dir_inum, file_name);
+}
+
+/*
+ * i-number of the file path names, from the root directory if it starts with
+ * '/' and from the current directory otherwise. return -1 if there is none
+ */
+static int resolve_path(int fs_fd, const char *path)
+{
+	char buf[256], *name, *save;
+	int inum, next;
+
+	if (strlen(path) >= sizeof(buf))
+		return -1;
+	strcpy(buf, path);
+	inum = path[0] == '/' ? ROOT_INUM : cur_dir_inum;
+	for (name = strtok_r(buf, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+		lock_inode(inum, 0);
+		next = dir_lookup(fs_fd, inum, name);
+		unlock_inode(inum);
+		if (next < 0)
+			return -1;
+		inum = next;
+	}
+	return inum;
+}
+
+/*
+ * return the number of block i of directory dir_inum for writing. a block
+ * still shared with a snapshot is copied first and the directory pointed at
+ * the copy. the caller holds the directory's lock and has called
+ * snap_cow_inode on it
+ */
+static int own_dir_block(int fs_fd, int dir_inum, struct inode *nd, int i)
+{
+	char buf[BLOCK_SIZE];
+	int b, shared, blk_idx;
+
+	b = nd->addr[i];
+	pthread_mutex_lock(&alloc_lock);
+	shared = blk_ref != NULL && blk_ref[b] > 1;
+	pthread_mutex_unlock(&alloc_lock);
+	if (!shared)
+		return b;
+
+	blk_idx = get_free_block(fs_fd);
+	if (blk_idx < 0)
+		return -1;
+	pread(fs_fd, buf, BLOCK_SIZE, b * BLOCK_SIZE);
+	pwrite(fs_fd, buf, BLOCK_SIZE, blk_idx * BLOCK_SIZE);
+	release_block(fs_fd, b);
+	nd->addr[i] = blk_idx;
+	pwrite(fs_fd, nd, USAGE_OFFSET, 2 * BLOCK_SIZE + (dir_inum-1) * INODE_SIZE);
+	return blk_idx;
+}
+
+/* i-number of the parent of directory inum, from its ".." entry */
+static int parent_dir(int fs_fd, int inum)
+{
+	struct inode nd;
+	struct dir_entry entry;
+
+	read_inode(fs_fd, inum, &nd);
+	pread(fs_fd, &entry, sizeof(entry), nd.addr[0] * BLOCK_SIZE + sizeof(entry));
+	return entry.i_num;
+}
+
+/*
+ * add blocks and inodes to the subtree totals of directory dir_inum and every
+ * directory above it. only the totals are written, so a concurrent change of
+ * another field of those i-nodes is not lost
+ */
+static void update_usage(int fs_fd, int dir_inum, int blocks, int inodes)
+{
+	struct dir_usage u;
+	int inum, parent, depth = 0;
+	off_t off;
+
+	pthread_mutex_lock(&usage_lock);
+	for (inum = dir_inum; depth++ < inode_num; inum = parent) {
+		off = 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE + USAGE_OFFSET;
+		snap_cow_inode(fs_fd, inum);
+		pread(fs_fd, &u, sizeof(u), off);
+		u.blocks += blocks;
+		u.inodes += inodes;
+		pwrite(fs_fd, &u, sizeof(u), off);
+		parent = parent_dir(fs_fd, inum);
+		if (parent == inum || parent <= 0 || parent > inode_num)
+			break;			//the root is its own parent
+	}
+	pthread_mutex_unlock(&usage_lock);
+}
+
+/* blocks owned by a file: its data blocks other than holes and indirect blocks */
+static int file_block_count(struct inode *nd, unsigned short *data, int n)
+{
+	int i, count = 0;
+
+	for (i = 0; i < n; i++)
+		if (data[i] != 0)
+			count++;
+	if (nd->flags & IS_LARGE)
+		for (i = 0; i < 8; i++)
+			if (nd->addr[i] != 0)
+				count++;
+	return count;
+}
+
+/*
+ * Initialize the V6 file system, there are block_num blocks and inode_num
+ * inodes in the disk. The first block is left unused. The second block is used
+ * as super block. I-nodes reside in the third and subsequent blocks
+ */
+static int init_v6fs(int fs_fd)
+{
+	unsigned int fs_size;
+	int i;
+	int cur_blk;
+	int inode_block_num;
+
+	if (initialized) {
+		fprintf(out_fp, "v6 file system has been initialized already\n");
+		return -1;
+	}
+	memset(&sp_blk, 0, sizeof(sp_blk));
+	free(dedup_table);
+	free(dedup_dirty);
+	dedup_table = NULL;
+	dedup_dirty = NULL;
+	blk_ref = NULL;
+	load_snap_table(fs_fd);			//sp_blk.snap_inum is 0 now
+
+	fs_size = BLOCK_SIZE * block_num;
+	if (ftruncate(fs_fd, fs_size) < 0) {
+		fprintf(out_fp, "Error: failed on setting the size of file system!\n");
+		return -1;
+	}
+
+	inode_block_num = (inode_num + 15) / 16;	//16 i-nodes fit into a block
+	inode_num = inode_block_num * 16;		//the rest of the last block is usable too
+	cur_blk = 2 + inode_block_num;
+	nfree = 0;
+	free_array[nfree++] = 0;			//initially set free_array[0] to 0
+	tfree = 0;
+
+	/* set all data blocks to free */
+	for (; cur_blk < block_num; cur_blk++)
+		add_free_block(fs_fd, cur_blk);
+
+	/* initialize all i-nodes data to 0 */
+	char buf[INODE_SIZE] = {0};
+	for (i = 0; i < inode_num; i++)
+		pwrite(fs_fd, buf, INODE_SIZE, 2 * BLOCK_SIZE + i * INODE_SIZE);
+
+	/*
+	 * initialize the root directory, i-node 1 is associated with root
+	 * directory. Add the first two entries "." and ".." to root directory,
+	 * where ".." has the same meaning as "."
+	 */
+	struct dir_entry entry1, entry2;
+	entry1.i_num = ROOT_INUM;
+	strcpy(entry1.name, ".");
+	entry2.i_num = ROOT_INUM;
+	strcpy(entry2.name, "..");
+
+	cur_blk = get_free_block(fs_fd);
+	pwrite(fs_fd, &entry1, sizeof(entry1), cur_blk * BLOCK_SIZE);
+	pwrite(fs_fd, &entry2, sizeof(entry2), cur_blk * BLOCK_SIZE + sizeof(entry1));
+	
+	/* fill in contents of i-node 1 */
+	struct inode nd;
+	memset(&nd, 0, sizeof(nd));
+	nd.flags = nd.flags | INODE_ALLOC | IS_DIR;
+	//fprintf(out_fp, "nd.flags = 0x%x\n", nd.flags);
+	nd.size1 = 2 * sizeof(entry1);
+	nd.addr[0] = cur_blk;
+	set_dir_usage(&nd, 1, 1);
+	pwrite(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE);
+
+	/* initialize ninode and inode array */
+	if ((inode_num - 1) < 100)
+		ninode = inode_num - 1;
+	else
+		ninode = 100;
+	for (i = 0; i < ninode; i++)
+		inode[i] = 2 + i;			//free i-numbers start from 2
+	tinode = inode_num - 1;
+
+	/* initialize the super block */
+	sp_blk.isize = inode_block_num;
+	sp_blk.fsize = block_num;
+	sp_blk.usage = 1;
+	update_super_block(fs_fd);
+	init_inode_locks();
+	//read_super_block(fs_fd);
+
+	initialized = 1;
+	cur_dir_inum = ROOT_INUM;
+
+	return 0;
+}
+
+
+#define LZ_HASH_BITS	12
+#define LZ_MIN_MATCH	4
+
+static unsigned int lz_read32(const unsigned char *p)
+{
+	unsigned int v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* write the part of a length that did not fit into its 4 bit token field */
+static int lz_put_len(unsigned char *dst, int op, int cap, int len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op >= cap)
+			return -1;
+		dst[op++] = 255;
+	}
+	if (op >= cap)
+		return -1;
+	dst[op++] = len;
+	return op;
+}
+
+/*
+ * emit one sequence: a token holding the literal and match lengths, the
+ * literals and, unless this is the last sequence, the 2 byte match offset
+ */
+static int lz_put_seq(unsigned char *dst, int op, int cap, const unsigned char *lit,
+		      int nlit, int offset, int mlen)
+{
+	int mcode = offset ? mlen - LZ_MIN_MATCH : 0;
+
+	if (op >= cap)
+		return -1;
+	dst[op++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+	if (nlit >= 15 && (op = lz_put_len(dst, op, cap, nlit - 15)) < 0)
+		return -1;
+	if (op + nlit > cap)
+		return -1;
+	memcpy(dst + op, lit, nlit);
+	op += nlit;
+	if (offset == 0)
+		return op;
+
+	if (op + 2 > cap)
+		return -1;
+	dst[op++] = offset & 0xff;
+	dst[op++] = offset >> 8;
+	if (mcode >= 15 && (op = lz_put_len(dst, op, cap, mcode - 15)) < 0)
+		return -1;
+	return op;
+}
+
+/*
+ * compress n bytes (n <= 64KB) with a small LZ77 coder in the style of LZ4.
+ * return the compressed length, or -1 if it does not fit into cap bytes
+ */
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	unsigned short htab[1 << LZ_HASH_BITS];
+	unsigned int seq, h;
+	int ip = 0, anchor = 0, op = 0, ref, mlen;
+
+	memset(htab, 0, sizeof(htab));
+	while (ip + LZ_MIN_MATCH <= n) {
+		seq = lz_read32(src + ip);
+		h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+		ref = htab[h] - 1;			//positions are kept + 1
+		htab[h] = ip + 1;
+		if (ref < 0 || lz_read32(src + ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = LZ_MIN_MATCH; ip + mlen < n && src[ref+mlen] == src[ip+mlen]; mlen++) ;
+		op = lz_put_seq(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+		if (op < 0)
+			return -1;
+		ip += mlen;
+		anchor = ip;
+	}
+
+	return lz_put_seq(dst, op, cap, src + anchor, n - anchor, 0, 0);
+}
+
+/* decompress n bytes into dst, return the decompressed length or -1 */
+static int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int ip = 0, op = 0, token, nlit, mlen, offset, b;
+
+	while (ip < n) {
+		token = src[ip++];
+		nlit = token >> 4;
+		if (nlit == 15) {
+			do {
+				if (ip >= n)
+					return -1;
+				b = src[ip++];
+				nlit += b;
+			} while (b == 255);
+		}
+		if (ip + nlit > n || op + nlit > cap)
+			return -1;
+		memcpy(dst + op, src + ip, nlit);
+		ip += nlit;
+		op += nlit;
+		if (ip == n)				//the last sequence has no match
+			break;
+
+		if (ip + 2 > n)
+			return -1;
+		offset = src[ip] | (src[ip+1] << 8);
+		ip += 2;
+		mlen = token & 15;
+		if (mlen == 15) {
+			do {
+				if (ip >= n)
+					return -1;
+				b = src[ip++];
+				mlen += b;
+			} while (b == 255);
+		}
+		mlen += LZ_MIN_MATCH;
+		if (offset == 0 || offset > op || op + mlen > cap)
+			return -1;
+		for (; mlen > 0; mlen--, op++)		//source and target may overlap
+			dst[op] = dst[op - offset];
+	}
+
+	return op;
+}
+
+/*
+ * chunks [first, last) of a compressed file, worked on by a pool of threads.
+ * chunk k holds the bytes at k * chunk_size of the uncompressed data, which
+ * is kept at data + (k - first) * chunk_size, and is stored compressed at
+ * comp + comp_off[k], comp_len[k] bytes long
+ */
+struct chunk_job {
+	unsigned char *data;
+	unsigned char *comp;
+	unsigned int *comp_off;
+	unsigned int *comp_len;
+	unsigned int size;		//uncompressed file size
+	unsigned int chunk_size;
+	int first, last;
+	int next;			//next chunk to be taken by a worker
+	int error;
+};
+
+static unsigned int chunk_data_len(struct chunk_job *job, int k)
+{
+	unsigned int n = job->size - k * job->chunk_size;
+	return n < job->chunk_size ? n : job->chunk_size;
+}
+
+static void *compress_worker(void *arg)
+{
+	struct chunk_job *job = arg;
+	unsigned char *in, *out;
+	unsigned int n;
+	int k, clen;
+
+	while ((k = __sync_fetch_and_add(&job->next, 1)) < job->last) {
+		n = chunk_data_len(job, k);
+		in = job->data + (k - job->first) * job->chunk_size;
+		out = job->comp + job->comp_off[k];
+		clen = lz_compress(in, n, out, n - 1);
+		if (clen < 0) {				//a chunk that doesn't shrink is kept raw
+			memcpy(out, in, n);
+			clen = n;
+		}
+		job->comp_len[k] = clen;
+	}
+	return NULL;
+}
+
+static void *decompress_worker(void *arg)
+{
+	struct chunk_job *job = arg;
+	unsigned char *in, *out;
+	unsigned int n;
+	int k;
+
+	while ((k = __sync_fetch_and_add(&job->next, 1)) < job->last) {
+		n = chunk_data_len(job, k);
+		in = job->comp + job->comp_off[k];
+		out = job->data + (k - job->first) * job->chunk_size;
+		if (job->comp_len[k] == n)
+			memcpy(out, in, n);
+		else if (lz_decompress(in, job->comp_len[k], out, n) != n)
+			job->error = 1;
+	}
+	return NULL;
+}
+
+/* number of worker threads to use for n independent jobs */
+static int worker_count(int n)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus > MAX_WORKERS)
+		cpus = MAX_WORKERS;
+	if (cpus > n)
+		cpus = n;
+	return cpus < 1 ? 1 : cpus;
+}
+
+/* run fn on up to n worker threads, the calling thread is one of them */
+static void run_workers(void *(*fn)(void *), void *job, int n)
+{
+	pthread_t tid[MAX_WORKERS];
+	int i, nthreads;
+
+	nthreads = worker_count(n);
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&tid[i], NULL, fn, job) != 0)
+			break;
+	nthreads = i;
+	fn(job);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(tid[i], NULL);
+}
+
+/*
+ * compress size bytes of data into a newly allocated stream made of the
+ * header, the chunk table and the chunks. return the stream length or -1
+ */
+static int compress_data(unsigned char *data, unsigned int size, unsigned char **stream)
+{
+	struct compress_header hdr;
+	struct chunk_job job;
+	unsigned int *offset;
+	unsigned char *buf = NULL;
+	unsigned int pos;
+	int k, ret = -1;
+
+	memset(&job, 0, sizeof(job));
+	job.data = data;
+	job.size = size;
+	job.chunk_size = COMPRESS_CHUNK;
+	job.last = (size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+	job.comp = malloc((unsigned long)job.last * COMPRESS_CHUNK + 1);
+	job.comp_off = malloc((job.last + 1) * sizeof(unsigned int));
+	job.comp_len = malloc((job.last + 1) * sizeof(unsigned int));
+	if (job.comp == NULL || job.comp_off == NULL || job.comp_len == NULL)
+		goto out;
+	for (k = 0; k < job.last; k++)
+		job.comp_off[k] = k * COMPRESS_CHUNK;
+	run_workers(compress_worker, &job, job.last);
+
+	pos = sizeof(hdr) + (job.last + 1) * sizeof(unsigned int);
+	for (k = 0; k < job.last; k++)
+		pos += job.comp_len[k];
+	buf = malloc(pos);
+	if (buf == NULL)
+		goto out;
+
+	hdr.size = size;
+	hdr.chunk_size = COMPRESS_CHUNK;
+	hdr.nchunks = job.last;
+	memcpy(buf, &hdr, sizeof(hdr));
+	offset = (unsigned int *)(buf + sizeof(hdr));
+	pos = sizeof(hdr) + (job.last + 1) * sizeof(unsigned int);
+	for (k = 0; k < job.last; k++) {
+		offset[k] = pos;
+		memcpy(buf + pos, job.comp + job.comp_off[k], job.comp_len[k]);
+		pos += job.comp_len[k];
+	}
+	offset[k] = pos;
+	*stream = buf;
+	ret = pos;
+out:
+	free(job.comp);
+	free(job.comp_off);
+	free(job.comp_len);
+	return ret;
+}
+
+/*
+ * read len bytes at offset pos of a file, given by its data blocks, into buf.
+ * holes read as zeros and a run of adjacent blocks is read at once
+ */
+static void read_file_bytes(int fs_fd, unsigned short *data, unsigned int pos,
+			    unsigned int len, unsigned char *buf)
+{
+	unsigned int blk, off, n;
+	int run;
+
+	while (len > 0) {
+		blk = pos / BLOCK_SIZE;
+		off = pos % BLOCK_SIZE;
+		for (run = 1; data[blk] != 0 && run * BLOCK_SIZE - off < len &&
+		     data[blk+run] == data[blk] + run; run++) ;
+		n = run * BLOCK_SIZE - off;
+		if (n > len)
+			n = len;
+		if (data[blk] == 0) {
+			memset(buf, 0, n);
+		} else {
+			pread(fs_fd, buf, n, data[blk] * BLOCK_SIZE + off);
+		}
+		buf += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* read and check the header of a compressed file */
+static int read_compress_header(int fs_fd, struct inode *nd, unsigned short *data,
+				struct compress_header *hdr)
+{
+	if (inode_file_size(nd) < sizeof(*hdr))
+		return -1;
+	read_file_bytes(fs_fd, data, 0, sizeof(*hdr), (unsigned char *)hdr);
+	if (hdr->chunk_size == 0 || hdr->chunk_size > 65536 ||
+	    hdr->nchunks != (hdr->size + hdr->chunk_size - 1) / hdr->chunk_size ||
+	    sizeof(*hdr) + (hdr->nchunks + 1) * sizeof(unsigned int) > inode_file_size(nd))
+		return -1;
+	return 0;
+}
+
+/*
+ * read len bytes at offset pos of the uncompressed contents of a compressed
+ * file into out. only the chunks covering the range are read, in one pass,
+ * and they are decompressed in parallel. return -1 if the file is damaged
+ */
+static int read_compressed(int fs_fd, struct inode *nd, unsigned short *data,
+			   unsigned int pos, unsigned int len, unsigned char *out)
+{
+	struct compress_header hdr;
+	struct chunk_job job;
+	unsigned int *offset;
+	unsigned int base;
+	int k, ret = -1;
+
+	if (read_compress_header(fs_fd, nd, data, &hdr) < 0 || pos + len > hdr.size)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	memset(&job, 0, sizeof(job));
+	offset = malloc((hdr.nchunks + 1) * sizeof(unsigned int));
+	job.comp_off = malloc((hdr.nchunks + 1) * sizeof(unsigned int));
+	job.comp_len = malloc((hdr.nchunks + 1) * sizeof(unsigned int));
+	if (offset == NULL || job.comp_off == NULL || job.comp_len == NULL)
+		goto out;
+	read_file_bytes(fs_fd, data, sizeof(hdr), (hdr.nchunks + 1) * sizeof(unsigned int),
+			(unsigned char *)offset);
+
+	job.size = hdr.size;
+	job.chunk_size = hdr.chunk_size;
+	job.first = job.next = pos / hdr.chunk_size;
+	job.last = (pos + len - 1) / hdr.chunk_size + 1;
+	base = offset[job.first];
+	for (k = job.first; k < job.last; k++) {
+		if (offset[k] > offset[k+1] || offset[k+1] > inode_file_size(nd) ||
+		    offset[k] < base)
+			goto out;
+		job.comp_off[k] = offset[k] - base;
+		job.comp_len[k] = offset[k+1] - offset[k];
+	}
+
+	job.comp = malloc(offset[job.last] - base + 1);
+	job.data = malloc((job.last - job.first) * hdr.chunk_size);
+	if (job.comp == NULL || job.data == NULL)
+		goto out;
+	read_file_bytes(fs_fd, data, base, offset[job.last] - base, job.comp);
+	run_workers(decompress_worker, &job, job.last - job.first);
+	if (job.error)
+		goto out;
+
+	memcpy(out, job.data + pos - job.first * hdr.chunk_size, len);
+	ret = 0;
+out:
+	free(offset);
+	free(job.comp_off);
+	free(job.comp_len);
+	free(job.comp);
+	free(job.data);
+	return ret;
+}
+
+/*
+ * find a home for one block of file data: an all-zero block is left as a hole
+ * (0 is returned), in dedup mode a block already stored with the same
+ * contents is shared, otherwise a new block is written. return -1 if there is
+ * no block left
+ */
+static int store_block(int fs_fd, char *buf, int *shared)
+{
+	struct dedup_slot *slot = NULL;
+	unsigned int hash = 0;
+	int blk_idx;
+
+	if (is_zero_block(buf))
+		return 0;
+	if (sp_blk.dedup && dedup_table != NULL) {
+		hash = block_hash(buf);
+		blk_idx = dedup_lookup(fs_fd, buf, hash, &slot);
+		if (blk_idx != 0) {
+			(*shared)++;
+			return blk_idx;
+		}
+	}
+
+	blk_idx = get_free_block(fs_fd);
+	if (blk_idx < 0)
+		return -1;
+	pwrite(fs_fd, buf, BLOCK_SIZE, blk_idx * BLOCK_SIZE);
+	if (sp_blk.dedup && dedup_table != NULL)
+		dedup_insert(slot, hash, blk_idx);
+	return blk_idx;
+}
+
+/* whether the current directory is still a directory, another session may have removed it */
+static int cur_dir_exists(int fs_fd)
+{
+	struct inode nd;
+
+	read_inode(fs_fd, cur_dir_inum, &nd);
+	return (nd.flags & (INODE_ALLOC | IS_DIR)) == (INODE_ALLOC | IS_DIR);
+}
+
+/* lock the current directory to change it, return -1 if it is gone */
+static int lock_cur_dir(int fs_fd)
+{
+	lock_inode(cur_dir_inum, 1);
+	if (cur_dir_exists(fs_fd))
+		return 0;
+	unlock_inode(cur_dir_inum);
+	fprintf(err_fp, "Error: the current directory has been removed!\n");
+	return -1;
+}
+
+/*
+ * add an entry for i-node inum to the current directory, the caller holds the
+ * directory's lock. blocks and inodes are what the new entry adds to the
+ * totals of the directories above it
+ */
+static void add_dir_entry(int fs_fd, int inum, char *v6_file, int blocks, int inodes)
+{
+	struct inode nd;
+	struct dir_entry entry;
+
+	entry.i_num = inum;
+	strcpy(entry.name, v6_file);
+	//fprintf(out_fp, "entry.i_num is %d, entry.name is %s\n", entry.i_num, entry.name);
+	snap_cow_inode(fs_fd, cur_dir_inum);
+	pread(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE);
+	int entry_idx, block_idx;
+	/* Let's suppose directory file is small file */
+	if (nd.size1 % BLOCK_SIZE == 0) {
+		block_idx = get_free_block(fs_fd);
+		entry_idx = 0;
+		nd.addr[nd.size1 / BLOCK_SIZE] = block_idx;
+		blocks++;
+	} else {
+		block_idx = own_dir_block(fs_fd, cur_dir_inum, &nd, nd.size1 / BLOCK_SIZE);
+		entry_idx = (nd.size1 % BLOCK_SIZE) / sizeof(entry);
+	}
+	//fprintf(out_fp, "block_idx = %d, entry_idx = %d\n", block_idx, entry_idx);
+	pwrite(fs_fd, &entry, sizeof(entry), block_idx * BLOCK_SIZE + entry_idx * sizeof(entry));
+
+	/* update contents of i-node representing current directory, its totals are left to update_usage */
+	nd.size1 += sizeof(entry);
+	pwrite(fs_fd, &nd, USAGE_OFFSET, 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE);
+	update_usage(fs_fd, cur_dir_inum, blocks, inodes);
+}
+
+/* a tiny file is kept in addr[] of its i-node, it takes no data block */
+static void cpin_inline(int fs_fd, FILE *ext, unsigned int file_size, char *v6_file)
+{
+	struct inode nd;
+	int inum;
+
+	inum = get_free_inode(fs_fd);
+	if (inum < 0)
+		return;
+	memset(&nd, 0, sizeof(nd));
+	nd.flags = INODE_ALLOC | IS_INLINE;
+	nd.size1 = file_size;
+	fseek(ext, 0, SEEK_SET);
+	fread(nd.addr, 1, file_size, ext);
+	write_inode(fs_fd, inum, &nd);
+	if (lock_cur_dir(fs_fd) < 0) {
+		free_inode(fs_fd, inum);
+		return;
+	}
+	add_dir_entry(fs_fd, inum, v6_file, 0, 1);
+	unlock_inode(cur_dir_inum);
+
+	fprintf(out_fp, "cpin command successfully executed, totally %d bytes copied\n", file_size);
+}
+
+static void cpin(int fs_fd, char *ext_file, char *v6_file)
+{
+	FILE *ext;
+	unsigned int file_size, stored_size;
+	int req_blk_num;
+	int i, blk_idx, inum, shared = 0;
+	char buf[BLOCK_SIZE];
+	unsigned char *file_data, *stream = NULL;
+	unsigned short data[MAX_FILE_BLOCKS];
+	struct inode nd;
+
+	ext = fopen(ext_file, "r");
+	if (ext == NULL) {
+		fprintf(err_fp, "open file %s failed!\n", ext_file);
+		return;
+	}
+
+	fseek(ext, 0, SEEK_END);
+	file_size = ftell(ext);
+	stored_size = file_size;
+
+	if (file_size > 0 && file_size <= INLINE_MAX) {
+		cpin_inline(fs_fd, ext, file_size, v6_file);
+		fclose(ext);
+		return;
+	}
+
+	/* in compress mode keep the compressed stream if it is any smaller */
+	if (sp_blk.compress && file_size > 0 && file_size <= COMPRESS_MAX_SIZE) {
+		file_data = malloc(file_size);
+		if (file_data != NULL) {
+			fseek(ext, 0, SEEK_SET);
+			fread(file_data, 1, file_size, ext);
+			i = compress_data(file_data, file_size, &stream);
+			if (i > 0 && i < file_size) {
+				stored_size = i;
+			} else {
+				free(stream);
+				stream = NULL;
+			}
+			free(file_data);
+		}
+	}
+
+	req_blk_num = (stored_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (req_blk_num > MAX_FILE_BLOCKS) {
+		fprintf(err_fp, "super large file, not supported!\n");
+		free(stream);
+		fclose(ext);
+		return;
+	}
+
+	inum = get_free_inode(fs_fd);
+	if (inum < 0) {
+		free(stream);
+		fclose(ext);
+		return;
+	}
+	memset(&nd, 0, sizeof(nd));
+	nd.flags |= INODE_ALLOC;
+	if (stream != NULL)
+		nd.flags |= IS_COMPRESSED;
+	nd.size0 = stored_size >> 16;
+	nd.size1 = (unsigned short)stored_size;
+	//fprintf(out_fp, "nd.size0 = %d, nd.size1 = %d\n", nd.size0, nd.size1);
+
+	fseek(ext, 0, SEEK_SET);
+	for (i = 0; i < req_blk_num; i++) {
+		memset(buf, 0, BLOCK_SIZE);
+		if (stream != NULL)
+			memcpy(buf, stream + i * BLOCK_SIZE, i < req_blk_num - 1 ?
+				BLOCK_SIZE : stored_size - i * BLOCK_SIZE);
+		else
+			fread(buf, 1, BLOCK_SIZE, ext);
+		blk_idx = store_block(fs_fd, buf, &shared);
+		if (blk_idx < 0)
+			break;
+		data[i] = blk_idx;
+	}
+	free(stream);
+	if (i < req_blk_num || set_file_blocks(fs_fd, &nd, data, req_blk_num) < 0) {
+		fprintf(err_fp, "Error: out of free blocks, %s has not been copied in!\n", ext_file);
+		while (i-- > 0)
+			if (data[i] != 0)
+				release_block(fs_fd, data[i]);
+		free_inode(fs_fd, inum);
+		fclose(ext);
+		return;
+	}
+
+	write_inode(fs_fd, inum, &nd);
+	if (lock_cur_dir(fs_fd) < 0) {
+		discard_file(fs_fd, inum);
+		fclose(ext);
+		return;
+	}
+	add_dir_entry(fs_fd, inum, v6_file, file_block_count(&nd, data, req_blk_num), 1);
+	unlock_inode(cur_dir_inum);
+
+	fprintf(out_fp, "cpin command successfully executed, totally %d bytes copied\n", file_size);
+	if (stored_size != file_size)
+		fprintf(out_fp, "compressed to %d bytes\n", stored_size);
+	if (shared)
+		fprintf(out_fp, "%d block(s) shared with existing files\n", shared);
+	fclose(ext);
+	return;
+}
+
+/*
+ * write out the uncompressed contents of a compressed file, a slice of chunks
+ * at a time so that memory use stays bounded. return the number of bytes
+ * written or -1
+ */
+static int cpout_compressed(int fs_fd, struct inode *nd, unsigned short *data, FILE *ext)
+{
+	struct compress_header hdr;
+	unsigned char *buf;
+	unsigned int pos, n, slice;
+
+	if (read_compress_header(fs_fd, nd, data, &hdr) < 0) {
+		fprintf(err_fp, "compressed file is damaged!\n");
+		return -1;
+	}
+	slice = hdr.chunk_size * 64;
+	buf = malloc(slice);
+	if (buf == NULL)
+		return -1;
+	for (pos = 0; pos < hdr.size; pos += n) {
+		n = hdr.size - pos < slice ? hdr.size - pos : slice;
+		if (read_compressed(fs_fd, nd, data, pos, n, buf) < 0) {
+			fprintf(err_fp, "compressed file is damaged!\n");
+			free(buf);
+			return -1;
+		}
+		fwrite(buf, 1, n, ext);
+	}
+	free(buf);
+	return hdr.size;
+}
+
+static void cpout(int fs_fd, char *v6_file, char *ext_file)
+{
+	FILE *ext;
+	unsigned int file_size;
+	int i, n, blk_idx, inum;
+	int total_block, nind, sparse, seeked = 0;
+	char buf[BLOCK_SIZE];
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	struct inode nd;
+	struct stat st;
+	//struct dir_entry entry;
+
+	if (is_dot_name(v6_file)) {
+		fprintf(err_fp, "%s is a directory, please check!\n", v6_file);
+		return;
+	}
+	lock_inode(cur_dir_inum, 0);
+	inum = locate_file(fs_fd, v6_file);
+	//fprintf(out_fp, "cpout: the inum retrurned is %d\n", inum);
+	if (inum >= 0)
+		lock_inode(inum, 0);
+	unlock_inode(cur_dir_inum);
+	if (inum < 0) {
+		fprintf(err_fp, "file %s does not exist in v6 file system, please check!\n", v6_file);
+		return;
+	}
+	ext = fopen(ext_file, "w");
+	if (ext == NULL) {
+		fprintf(err_fp, "open file %s failed!\n", ext_file);
+		unlock_inode(inum);
+		return;
+	}
+
+	pread(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE);
+	file_size = inode_file_size(&nd);
+	//fprintf(out_fp, "nd.size0 = %d, nd.size1 = %d, file_size = %d\n", nd.size0, nd.size1, file_size);
+	if (nd.flags & IS_INLINE) {
+		fwrite(nd.addr, 1, file_size, ext);
+	} else if (nd.flags & IS_COMPRESSED) {
+		get_file_blocks(fs_fd, &nd, data, ind, &nind);
+		if ((n = cpout_compressed(fs_fd, &nd, data, ext)) < 0)
+			goto out;
+		file_size = n;
+	} else {
+		total_block = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+		sparse = fstat(fileno(ext), &st) == 0 && S_ISREG(st.st_mode);	//pipes and devices get zeros
+		for (i = 0; i < total_block; i++) {
+			n = BLOCK_SIZE;
+			if (i == total_block - 1 && (file_size % BLOCK_SIZE) != 0)
+				n = file_size % BLOCK_SIZE;
+			blk_idx = data[i];
+			seeked = 0;
+			if (blk_idx == 0) {		//hole, skip over it in a regular file
+				if (sparse && fseek(ext, n, SEEK_CUR) == 0) {
+					seeked = 1;
+					continue;
+				}
+				memset(buf, 0, n);
+			} else {
+				pread(fs_fd, buf, n, blk_idx * BLOCK_SIZE);
+			}
+			fwrite(buf, 1, n, ext);
+		}
+		/* a trailing hole is only materialized by setting the file size */
+		if (fflush(ext) != 0 || (seeked && ftruncate(fileno(ext), file_size) < 0)) {
+			fprintf(err_fp, "write to file %s failed!\n", ext_file);
+			goto out;
+		}
+	}
+
+	fprintf(out_fp, "cpout command successfully executed, %d bytes written to file %s\n",
+		file_size, ext_file);
+out:
+	fclose(ext);
+	unlock_inode(inum);
+	return;
+}
+
+static void make_dir(int fs_fd, char *v6_dir)
+{
+	int inum, blk_idx;
+	struct inode nd;
+	struct dir_entry entry1, entry2;
+
+	if (lock_cur_dir(fs_fd) < 0)
+		return;
+	if (locate_file(fs_fd, v6_dir) != -1) {
+		fprintf(out_fp, "file with same name exists in current directory, "
+			"please rename the directory file\n");
+		unlock_inode(cur_dir_inum);
+		return;
+	}
+
+	inum = get_free_inode(fs_fd);
+	entry1.i_num = inum;
+	strcpy(entry1.name, ".");
+	entry2.i_num = cur_dir_inum;
+	strcpy(entry2.name, "..");
+
+	blk_idx = get_free_block(fs_fd);
+	pwrite(fs_fd, &entry1, sizeof(entry1), blk_idx * BLOCK_SIZE);
+	pwrite(fs_fd, &entry2, sizeof(entry2), blk_idx * BLOCK_SIZE + sizeof(entry1));
+
+	memset(&nd, 0, sizeof(nd));
+	nd.flags = INODE_ALLOC | IS_DIR;
+	nd.size1 = 2 * sizeof(entry1);
+	nd.addr[0] = blk_idx;
+	set_dir_usage(&nd, 1, 1);
+	write_inode(fs_fd, inum, &nd);
+
+
+	/* create corresponding entry in current directory */
+	add_dir_entry(fs_fd, inum, v6_dir, 1, 1);
+	unlock_inode(cur_dir_inum);
+
+	return;
+}
+
+
+static void remove_dir_entry(int fs_fd, int dir_inum, char *name)
+{
+	struct inode nd;
+	struct dir_entry entries[DIR_ENTRY_MAX];
+	int i, n, per_blk, blk;
+
+	per_blk = BLOCK_SIZE / sizeof(struct dir_entry);
+	snap_cow_inode(fs_fd, dir_inum);
+	read_inode(fs_fd, dir_inum, &nd);
+	n = read_dir(fs_fd, &nd, entries);
+	for (i = 0; i < n; i++) {
+		if (entries[i].i_num == 0 || strcmp(entries[i].name, name) != 0)
+			continue;
+		if ((blk = own_dir_block(fs_fd, dir_inum, &nd, i / per_blk)) < 0)
+			return;
+		memset(&entries[i], 0, sizeof(entries[i]));
+		pwrite(fs_fd, &entries[i], sizeof(entries[i]),
+			blk * BLOCK_SIZE + (i % per_blk) * sizeof(entries[i]));
+		return;
+	}
+}
+
+/* blocks and i-nodes collected for a removal */
+struct rm_batch {
+	unsigned short *blocks;
+	int nblocks, blocks_cap;
+	int *inums;
+	int ninums, inums_cap;
+	unsigned char *taken;		//taken[inum] once inum is in inums
+	int usage_blocks;		//blocks the removal takes off the du totals
+};
+
+static int rm_batch_add_block(struct rm_batch *rb, unsigned short b)
+{
+	unsigned short *p;
+
+	if (rb->nblocks == rb->blocks_cap) {
+		p = realloc(rb->blocks, (rb->blocks_cap * 2 + 256) * sizeof(*p));
+		if (p == NULL)
+			return -1;
+		rb->blocks = p;
+		rb->blocks_cap = rb->blocks_cap * 2 + 256;
+	}
+	rb->blocks[rb->nblocks++] = b;
+	return 0;
+}
+
+/* return -1 if out of memory or inum is not a sane i-number, 1 if it was added before */
+static int rm_batch_add_inum(struct rm_batch *rb, int inum)
+{
+	int *p;
+
+	if (inum < 1 || inum > inode_num)
+		return -1;
+	if (rb->taken == NULL && (rb->taken = calloc(inode_num + 1, 1)) == NULL)
+		return -1;
+	if (rb->taken[inum])
+		return 1;
+	if (rb->ninums == rb->inums_cap) {
+		p = realloc(rb->inums, (rb->inums_cap * 2 + 64) * sizeof(*p));
+		if (p == NULL)
+			return -1;
+		rb->inums = p;
+		rb->inums_cap = rb->inums_cap * 2 + 64;
+	}
+	rb->inums[rb->ninums++] = inum;
+	rb->taken[inum] = 1;
+	return 0;
+}
+
+/*
+ * lock i-node inum and, for a directory, everything below it, and collect
+ * their i-numbers and data, indirect and directory blocks. an i-node is
+ * locked only once it is recorded in rb->inums, the locks are held until the
+ * removal is finished
+ */
+static int collect_rm(int fs_fd, int inum, struct rm_batch *rb)
+{
+	struct inode nd;
+	struct dir_entry entries[DIR_ENTRY_MAX];
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	int i, n, nind, shared;
+
+	if (rm_batch_add_inum(rb, inum) != 0)	//1 for a loop in a damaged tree
+		return -1;
+	lock_inode(inum, 1);
+	snap_cow_inode(fs_fd, inum);
+	read_inode(fs_fd, inum, &nd);
+
+	if (nd.flags & IS_DIR) {
+		n = read_dir(fs_fd, &nd, entries);
+		for (i = 0; i < n; i++) {
+			if (entries[i].i_num == 0 || is_dot_name(entries[i].name))
+				continue;
+			if (collect_rm(fs_fd, entries[i].i_num, rb) < 0)
+				return -1;
+		}
+	}
+
+	n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+	rb->usage_blocks += file_block_count(&nd, data, n);
+	for (i = 0; i < nind; i++) {
+		if (ind[i] == 0)
+			continue;
+		if (rm_batch_add_block(rb, ind[i]) < 0)
+			return -1;
+		pthread_mutex_lock(&alloc_lock);
+		shared = blk_ref != NULL && blk_ref[ind[i]] > 1;
+		pthread_mutex_unlock(&alloc_lock);
+		if (shared)		//a snapshot keeps the data blocks below it
+			memset(&data[i * ADDR_PER_BLOCK], 0, ADDR_PER_BLOCK * sizeof(data[0]));
+	}
+	for (i = 0; i < n; i++)
+		if (data[i] != 0 && rm_batch_add_block(rb, data[i]) < 0)	//holes own no block
+			return -1;
+	return 0;
+}
+
+/* free a file that never got its directory entry */
+static void discard_file(int fs_fd, int inum)
+{
+	struct rm_batch rb;
+	int i;
+
+	memset(&rb, 0, sizeof(rb));
+	if (collect_rm(fs_fd, inum, &rb) == 0) {
+		release_block_batch(fs_fd, rb.blocks, rb.nblocks);
+		free_inode_batch(fs_fd, rb.inums, rb.ninums);
+	}
+	for (i = 0; i < rb.ninums; i++)
+		unlock_inode(rb.inums[i]);
+	free(rb.blocks);
+	free(rb.inums);
+	free(rb.taken);
+}
+
+/*
+ * delete v6_file from the current directory, with recursive set a directory
+ * is deleted together with everything below it. all blocks are collected
+ * first and freed in one sorted batch, then the i-nodes are freed a block of
+ * the i-list at a time
+ */
+static void remove_file(int fs_fd, char *v6_file, int recursive)
+{
+	struct rm_batch rb;
+	struct inode nd;
+	int i, inum, ret;
+
+	if (is_dot_name(v6_file)) {
+		fprintf(out_fp, "cannot delete %s\n", v6_file);
+		return;
+	}
+	if (lock_cur_dir(fs_fd) < 0)
+		return;
+	inum = locate_file(fs_fd, v6_file);
+	if (inum < 0) {
+		fprintf(out_fp, "file %s does not exist in current directory, please check!\n", v6_file);
+		unlock_inode(cur_dir_inum);
+		return;
+	}
+
+	read_inode(fs_fd, inum, &nd);
+	if ((nd.flags & IS_DIR) != 0 && !recursive) {
+		fprintf(out_fp, "%s is a directory, use rm -r to delete it\n", v6_file);
+		unlock_inode(cur_dir_inum);
+		return;
+	}
+
+	memset(&rb, 0, sizeof(rb));
+	ret = collect_rm(fs_fd, inum, &rb);
+	if (ret == 0) {
+		release_block_batch(fs_fd, rb.blocks, rb.nblocks);
+		free_inode_batch(fs_fd, rb.inums, rb.ninums);
+
+		/* delete corresponding directory entry */
+		remove_dir_entry(fs_fd, cur_dir_inum, v6_file);
+		update_usage(fs_fd, cur_dir_inum, -rb.usage_blocks, -rb.ninums);
+		if (nd.flags & IS_DIR)		//sessions inside it check their directory
+			__sync_fetch_and_add(&rm_gen, 1);
+	}
+	for (i = 0; i < rb.ninums; i++)
+		unlock_inode(rb.inums[i]);
+	unlock_inode(cur_dir_inum);
+	free(rb.blocks);
+	free(rb.inums);
+	free(rb.taken);
+
+	//need update inode(like file_size) of current directory and move back
+	//entries forward
+
+	if (ret < 0)
+		fprintf(err_fp, "Error: failed to delete %s, nothing has been deleted\n", v6_file);
+	else
+		fprintf(out_fp, "command successfully executed, file %s has been deleted\n",v6_file);
+	return;
+}
+
+static void access_dir(int fs_fd, char *v6_dir)
+{
+	int inum;
+	char *dir_name, *save;
+
+	dir_name = strtok_r(v6_dir, "/", &save);
+	//fprintf(out_fp, "dir_name is %s\n", dir_name);
+	lock_inode(cur_dir_inum, 0);
+	inum = dir_name ? locate_file(fs_fd, dir_name) : -1;
+	unlock_inode(cur_dir_inum);
+	if (inum < 0) {
+		fprintf(out_fp, "directory %s does not exist in current directory, please check!\n", v6_dir);
+		return;
+	}
+
+	cur_dir_inum = inum;
+}
+
+/* check whether the file associated with inum is a directory file */
+static int is_dir(int fs_fd, int inum)
+{
+	struct inode nd;
+
+	pread(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE);
+	if ((nd.flags & IS_DIR) == 0)
+		return 0;
+	else
+		return 1;
+}
+
+static void list_files(int fs_fd)
+{
+	int inum, blk_idx;
+	int i, j;
+	struct inode nd;
+	struct dir_entry entry;
+
+	inum = cur_dir_inum;
+	lock_inode(inum, 0);
+	pread(fs_fd, &nd, sizeof(nd), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE);
+	for (i = 0; i < (nd.size1 / BLOCK_SIZE); i++) {
+		blk_idx = nd.addr[i];
+		for (j = 0; j < BLOCK_SIZE / sizeof(entry); j++) {
+			pread(fs_fd, &entry, sizeof(entry), blk_idx * BLOCK_SIZE + j * sizeof(entry));
+			if (entry.i_num == 0)
+				continue;
+			fprintf(out_fp, "%s", entry.name);
+			if (is_dir(fs_fd, entry.i_num))
+				fprintf(out_fp, "/");
+			fprintf(out_fp, "    ");
+		}
+	}
+	if ((nd.size1 % BLOCK_SIZE) != 0) {
+		blk_idx = nd.addr[i];
+		for (j = 0; j < (nd.size1 % BLOCK_SIZE) / sizeof(entry); j++) {
+			pread(fs_fd, &entry, sizeof(entry), blk_idx * BLOCK_SIZE + j * sizeof(entry));
+			if (entry.i_num == 0)
+				continue;
+			fprintf(out_fp, "%s", entry.name);
+			if (is_dir(fs_fd, entry.i_num))
+				fprintf(out_fp, "/");
+			fprintf(out_fp, "    ");
+		}
+	}
+	unlock_inode(inum);
+
+	fprintf(out_fp, "\n");
+}
+
+/*
+ * walk the free block chain and return a map with one byte per block, set to
+ * 1 for every free block (chain blocks themselves are free blocks as well)
+ */
+static unsigned char *build_free_map(int fs_fd)
+{
+	unsigned char *free_map;
+	unsigned short n, arr[100];
+	int i, hops = 0;
+
+	free_map = calloc(block_num, 1);
+	if (free_map == NULL)
+		return NULL;
+
+	n = nfree;
+	memcpy(arr, free_array, sizeof(arr));
+	while (n > 0 && n <= 100 && hops++ < block_num) {
+		for (i = 1; i < n; i++)
+			if (arr[i] < block_num)
+				free_map[arr[i]] = 1;
+		if (arr[0] == 0 || arr[0] >= block_num)
+			break;
+		free_map[arr[0]] = 1;
+		pread(fs_fd, &n, sizeof(n), arr[0] * BLOCK_SIZE);
+		pread(fs_fd, arr, sizeof(arr), arr[0] * BLOCK_SIZE + sizeof(n));
+	}
+
+	return free_map;
+}
+
+/*
+ * rebuild the free block chain from free_map. blocks are added from the top of
+ * the disk down, so get_free_block hands them out in ascending order and files
+ * allocated afterwards come out sequential
+ */
+static void rebuild_free_list(int fs_fd, unsigned char *free_map)
+{
+	int b;
+
+	nfree = 0;
+	free_array[nfree++] = 0;
+	tfree = 0;
+	for (b = block_num - 1; b >= 2 + sp_blk.isize; b--)
+		if (free_map[b])
+			add_free_block(fs_fd, b);
+}
+
+/* number of contiguous runs in a sequence of block numbers */
+static int count_extents(unsigned short *seq, int n)
+{
+	int i, extents = 0;
+
+	for (i = 0; i < n; i++)
+		if (i == 0 || seq[i] != seq[i-1] + 1)
+			extents++;
+	return extents;
+}
+
+/*
+ * lay out the blocks of a file the way they are read: a large file's indirect
+ * block is followed by the data blocks it points to. holes are left out
+ */
+static int layout_file_blocks(unsigned short *data, int ndata,
+			      unsigned short *ind, int nind, unsigned short *seq)
+{
+	int i, j, n = 0;
+
+	if (nind == 0) {
+		for (j = 0; j < ndata; j++)
+			if (data[j] != 0)
+				seq[n++] = data[j];
+		return n;
+	}
+	for (i = 0; i < nind; i++) {
+		if (ind[i] == 0)
+			continue;
+		seq[n++] = ind[i];
+		for (j = i * ADDR_PER_BLOCK; j < ndata && j < (i+1) * ADDR_PER_BLOCK; j++)
+			if (data[j] != 0)
+				seq[n++] = data[j];
+	}
+	return n;
+}
+
+/* first fit search for n contiguous free blocks, return the first one or -1 */
+static int find_free_extent(unsigned char *free_map, int n)
+{
+	int b, run = 0;
+
+	for (b = 2 + sp_blk.isize; b < block_num; b++) {
+		run = free_map[b] ? run + 1 : 0;
+		if (run == n)
+			return b - n + 1;
+	}
+	return -1;
+}
+
+/*
+ * move file inum into a contiguous free extent. old blocks are read a run at a
+ * time and the new extent is written with a single sequential write, the
+ * i-node is written last so that it switches to the new copy in one step.
+ * before and after receive the extent counts, return -1 if the file could not
+ * be moved
+ */
+static int defrag_inode(int fs_fd, int inum, unsigned char *free_map,
+			int *before, int *after)
+{
+	struct inode nd;
+	unsigned short data[MAX_FILE_BLOCKS], ind[7], seq[MAX_FILE_BLOCKS + 7];
+	unsigned short indirect_block_data[ADDR_PER_BLOCK];
+	char *buf;
+	int ndata, nind, n, start, run;
+	int i, j, k;
+
+	*before = *after = 0;
+	read_inode(fs_fd, inum, &nd);
+	if ((nd.flags & INODE_ALLOC) == 0)
+		return 0;
+	ndata = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+	n = layout_file_blocks(data, ndata, ind, nind, seq);
+	*before = *after = count_extents(seq, n);
+	if (*before <= 1)
+		return 0;
+	if (snap_shared_inode(inum))		//a snapshot has the same blocks
+		return -1;
+	if (blk_ref != NULL)
+		for (i = 0; i < n; i++)
+			if (blk_ref[seq[i]] > 1)		//shared with another file
+				return -1;
+
+	start = find_free_extent(free_map, n);
+	if (start < 0)
+		return -1;
+	buf = malloc(n * BLOCK_SIZE);
+	if (buf == NULL)
+		return -1;
+
+	/* gather the old blocks, one read per contiguous run */
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && seq[i+run] == seq[i] + run; run++) ;
+		pread(fs_fd, buf + i * BLOCK_SIZE, run * BLOCK_SIZE, seq[i] * BLOCK_SIZE);
+	}
+
+	/* the new location of each block is start + its position in seq */
+	k = 0;
+	if (nind == 0) {
+		for (i = 0; i < ndata; i++)
+			if (data[i] != 0)
+				nd.addr[i] = start + k++;
+	} else {
+		for (i = 0; i < nind; i++) {
+			if (ind[i] == 0)
+				continue;
+			memset(indirect_block_data, 0, sizeof(indirect_block_data));
+			nd.addr[i] = start + k++;
+			for (j = 0; j < ADDR_PER_BLOCK && i * ADDR_PER_BLOCK + j < ndata; j++)
+				if (data[i * ADDR_PER_BLOCK + j] != 0)
+					indirect_block_data[j] = start + k++;
+			memcpy(buf + (nd.addr[i] - start) * BLOCK_SIZE, indirect_block_data,
+				BLOCK_SIZE);
+		}
+	}
+
+	pwrite(fs_fd, buf, n * BLOCK_SIZE, start * BLOCK_SIZE);
+	write_inode(fs_fd, inum, &nd);
+	free(buf);
+
+	for (i = 0; i < n; i++) {
+		free_map[seq[i]] = 1;
+		set_blk_ref(seq[i], 0);
+	}
+	memset(free_map + start, 0, n);
+	*after = 1;
+	return 0;
+}
+
+/* collect the i-numbers of directory dir_inum and everything below it */
+static int collect_subtree(int fs_fd, int dir_inum, int *inums, int count)
+{
+	struct inode nd;
+	struct dir_entry entries[DIR_ENTRY_MAX];
+	int i, n;
+
+	inums[count++] = dir_inum;
+	read_inode(fs_fd, dir_inum, &nd);
+	if ((nd.flags & IS_DIR) == 0)
+		return count;
+
+	n = read_dir(fs_fd, &nd, entries);
+	for (i = 0; i < n && count < inode_num; i++) {
+		if (entries[i].i_num == 0 || strcmp(entries[i].name, ".") == 0 ||
+		    strcmp(entries[i].name, "..") == 0)
+			continue;
+		count = collect_subtree(fs_fd, entries[i].i_num, inums, count);
+	}
+	return count;
+}
+
+/*
+ * defragment v6_file (a directory is done together with everything below it),
+ * or every allocated file if v6_file is NULL. the free chain is rebuilt in
+ * sorted order afterwards
+ */
+static void defrag(int fs_fd, char *v6_file)
+{
+	unsigned char *free_map;
+	int *inums;
+	int count, i, inum;
+	int before, after, total_before = 0, total_after = 0, failed = 0;
+
+	if (block_num == 0) {
+		fprintf(out_fp, "v6 file system has not been initialized yet\n");
+		return;
+	}
+
+	inums = malloc((inode_num + 1) * sizeof(int));
+	if (inums == NULL)
+		return;
+	if (v6_file == NULL) {
+		for (count = 0; count < inode_num; count++)
+			inums[count] = count + 1;
+	} else {
+		inum = locate_file(fs_fd, v6_file);
+		if (inum < 0) {
+			fprintf(out_fp, "file %s does not exist in current directory, please check!\n", v6_file);
+			free(inums);
+			return;
+		}
+		count = collect_subtree(fs_fd, inum, inums, 0);
+	}
+
+	free_map = build_free_map(fs_fd);
+	if (free_map == NULL) {
+		free(inums);
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (defrag_inode(fs_fd, inums[i], free_map, &before, &after) < 0)
+			failed++;
+		total_before += before;
+		total_after += after;
+	}
+	rebuild_free_list(fs_fd, free_map);
+
+	fprintf(out_fp, "defrag command successfully executed, extents: %d before, %d after\n",
+		total_before, total_after);
+	if (failed)
+		fprintf(out_fp, "%d file(s) left in place, blocks shared or no contiguous "
+			"free extent large enough\n", failed);
+	free(free_map);
+	free(inums);
+}
+
+/*
+ * sum up the subtree below i-node inum into u and store the totals of every
+ * directory on the way
+ */
+static void count_subtree(int fs_fd, int inum, struct dir_usage *u, int depth)
+{
+	struct inode nd;
+	struct dir_entry entries[DIR_ENTRY_MAX];
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	struct dir_usage sub;
+	int i, n, nind;
+
+	read_inode(fs_fd, inum, &nd);
+	n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+	u->blocks = file_block_count(&nd, data, n);
+	u->inodes = 1;
+	if ((nd.flags & IS_DIR) == 0 || depth > inode_num)
+		return;
+
+	n = read_dir(fs_fd, &nd, entries);
+	for (i = 0; i < n; i++) {
+		if (entries[i].i_num == 0 || is_dot_name(entries[i].name))
+			continue;
+		count_subtree(fs_fd, entries[i].i_num, &sub, depth + 1);
+		u->blocks += sub.blocks;
+		u->inodes += sub.inodes;
+	}
+	snap_cow_inode(fs_fd, inum);
+	pwrite(fs_fd, u, sizeof(*u), 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE + USAGE_OFFSET);
+}
+
+/*
+ * an image made before the counters were kept gets them computed once, by
+ * walking the free list, the i-list and the directory tree
+ */
+static void recount_usage(int fs_fd)
+{
+	unsigned char *free_map;
+	struct inode nd;
+	struct dir_usage u;
+	int i;
+
+	free_map = build_free_map(fs_fd);
+	if (free_map == NULL)
+		return;
+	tfree = 0;
+	for (i = 0; i < block_num; i++)
+		tfree += free_map[i];
+	free(free_map);
+
+	tinode = 0;
+	for (i = 1; i <= inode_num; i++) {
+		read_inode(fs_fd, i, &nd);
+		if ((nd.flags & INODE_ALLOC) == 0)
+			tinode++;
+	}
+
+	count_subtree(fs_fd, ROOT_INUM, &u, 0);
+	sp_blk.usage = 1;
+	update_super_block(fs_fd);
+}
+
+/* print free and used blocks and i-nodes, straight from the counters */
+static void disk_free(void)
+{
+	int total_blocks, free_blocks, free_inodes;
+
+	pthread_mutex_lock(&alloc_lock);
+	free_blocks = tfree;
+	free_inodes = tinode;
+	pthread_mutex_unlock(&alloc_lock);
+
+	total_blocks = block_num - 2 - sp_blk.isize;
+	fprintf(out_fp, "blocks:   %d total, %d used, %d free\n",
+		total_blocks, total_blocks - free_blocks, free_blocks);
+	fprintf(out_fp, "i-nodes:  %d total, %d used, %d free\n",
+		inode_num, inode_num - free_inodes, free_inodes);
+}
+
+/*
+ * print the blocks and i-nodes used by v6_file in the current directory, or
+ * by the current directory itself. a directory answers from its totals
+ */
+static void disk_usage(int fs_fd, char *v6_file)
+{
+	struct inode nd;
+	struct dir_usage u;
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	int inum, n, nind;
+
+	lock_inode(cur_dir_inum, 0);
+	inum = v6_file ? locate_file(fs_fd, v6_file) : cur_dir_inum;
+	unlock_inode(cur_dir_inum);
+	if (inum < 0) {
+		fprintf(out_fp, "file %s does not exist in current directory, please check!\n", v6_file);
+		return;
+	}
+
+	pthread_mutex_lock(&usage_lock);
+	read_inode(fs_fd, inum, &nd);
+	pthread_mutex_unlock(&usage_lock);
+	if (nd.flags & IS_DIR) {
+		get_dir_usage(&nd, &u);
+	} else {
+		n = get_file_blocks(fs_fd, &nd, data, ind, &nind);
+		u.blocks = file_block_count(&nd, data, n);
+		u.inodes = 1;
+	}
+	fprintf(out_fp, "%u blocks (%u bytes), %u i-nodes\t%s\n", u.blocks,
+		u.blocks * BLOCK_SIZE, u.inodes, v6_file ? v6_file : ".");
+}
+
+/* read the i-list blocks [k, k + n) into buf with a single read */
+static void read_ilist(int fs_fd, int k, int n, struct inode *buf)
+{
+	pread(fs_fd, buf, n * BLOCK_SIZE, (2 + k) * BLOCK_SIZE);
+}
+
+/*
+ * data blocks of i-node nd in file order, with the indirect blocks taken from
+ * ind_data (ind_slot[b] is the position of indirect block b in it) instead of
+ * being read again. return the number of blocks
+ */
+static int archive_file_blocks(struct inode *nd, unsigned short *ind_data,
+			       int *ind_slot, unsigned short *data)
+{
+	int i, n, total_block;
+
+	total_block = (inode_file_size(nd) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if ((nd->flags & IS_INLINE) || (nd->flags & INODE_ALLOC) == 0)
+		return 0;
+	if ((nd->flags & IS_LARGE) == 0) {
+		for (i = 0; i < total_block && i < 8; i++)
+			data[i] = nd->addr[i];
+		return i;
+	}
+	if (total_block > MAX_FILE_BLOCKS)
+		total_block = MAX_FILE_BLOCKS;
+	for (i = 0; i * ADDR_PER_BLOCK < total_block; i++) {
+		n = total_block - i * ADDR_PER_BLOCK;
+		if (n > ADDR_PER_BLOCK)
+			n = ADDR_PER_BLOCK;
+		if (nd->addr[i] == 0)
+			memset(&data[i * ADDR_PER_BLOCK], 0, n * sizeof(unsigned short));
+		else
+			memcpy(&data[i * ADDR_PER_BLOCK], &ind_data[ind_slot[nd->addr[i]] * ADDR_PER_BLOCK],
+				n * sizeof(unsigned short));
+	}
+	return total_block;
+}
+
+static int cmp_blk_asc(const void *a, const void *b)
+{
+	return *(const unsigned short *)a - *(const unsigned short *)b;
+}
+
+/*
+ * write the live tree to out as an archive. every read goes up the disk: the
+ * i-list, then the indirect blocks in ascending order, then the i-list again
+ * and a single sweep over the data blocks in use
+ */
+static int export_archive(int fs_fd, FILE *out)
+{
+	struct archive_header hdr;
+	struct archive_rec rec;
+	struct inode *ilist;
+	unsigned short *inds = NULL, *ind_data = NULL, data[MAX_FILE_BLOCKS];
+	unsigned char *used = NULL;
+	int *ind_slot = NULL;
+	char *buf = NULL;
+	int i, j, k, n, nk, inum, ninds = 0, nfiles = 0, nblocks = 0, run, ret = -1;
+
+	if (block_num == 0) {
+		fprintf(out_fp, "v6 file system has not been initialized yet\n");
+		return -1;
+	}
+	ilist = malloc(AR_RUN_MAX * BLOCK_SIZE);
+	inds = malloc(inode_num * 7 * sizeof(unsigned short));
+	ind_slot = malloc(block_num * sizeof(int));
+	used = calloc(block_num, 1);
+	buf = malloc(AR_RUN_MAX * BLOCK_SIZE);
+	if (ilist == NULL || inds == NULL || ind_slot == NULL || used == NULL || buf == NULL)
+		goto out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, "V6AR", 4);
+	hdr.version = 1;
+	hdr.isize = sp_blk.isize;
+	hdr.block_num = block_num;
+	hdr.inode_num = inode_num;
+	hdr.dedup = sp_blk.dedup;
+	hdr.compress = sp_blk.compress;
+	fwrite(&hdr, sizeof(hdr), 1, out);
+
+	/* the indirect blocks of all large files, read in ascending order */
+	for (k = 0; k < sp_blk.isize; k += nk) {
+		nk = sp_blk.isize - k < AR_RUN_MAX ? sp_blk.isize - k : AR_RUN_MAX;
+		read_ilist(fs_fd, k, nk, ilist);
+		for (j = 0; j < nk * 16; j++) {
+			inum = k * 16 + j + 1;
+			if (inum > inode_num || is_hidden_inum(inum) ||
+			    (ilist[j].flags & INODE_ALLOC) == 0 || (ilist[j].flags & IS_INLINE) ||
+			    (ilist[j].flags & IS_LARGE) == 0)
+				continue;
+			for (i = 0; i < 7; i++)
+				if (ilist[j].addr[i] != 0)
+					inds[ninds++] = ilist[j].addr[i];
+		}
+	}
+	qsort(inds, ninds, sizeof(unsigned short), cmp_blk_asc);
+	ind_data = malloc((ninds + 1) * BLOCK_SIZE);
+	if (ind_data == NULL)
+		goto out;
+	for (i = 0; i < ninds; i++) {
+		ind_slot[inds[i]] = i;
+		pread(fs_fd, &ind_data[i * ADDR_PER_BLOCK], BLOCK_SIZE, inds[i] * BLOCK_SIZE);
+	}
+
+	/* one record per file */
+	for (k = 0; k < sp_blk.isize; k += nk) {
+		nk = sp_blk.isize - k < AR_RUN_MAX ? sp_blk.isize - k : AR_RUN_MAX;
+		read_ilist(fs_fd, k, nk, ilist);
+		for (j = 0; j < nk * 16; j++) {
+			inum = k * 16 + j + 1;
+			if (inum > inode_num || is_hidden_inum(inum) ||
+			    (ilist[j].flags & INODE_ALLOC) == 0)
+				continue;
+			n = archive_file_blocks(&ilist[j], ind_data, ind_slot, data);
+			for (i = 0; i < n; i++)
+				if (data[i] != 0 && data[i] < block_num)
+					used[data[i]] = 1;
+			rec.type = AR_INODE;
+			rec.inum = inum;
+			rec.start = 0;
+			rec.count = n;
+			fwrite(&rec, sizeof(rec), 1, out);
+			fwrite(&ilist[j], sizeof(struct inode), 1, out);
+			fwrite(data, sizeof(unsigned short), n, out);
+			nfiles++;
+		}
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.type = AR_END_INODES;
+	fwrite(&rec, sizeof(rec), 1, out);
+
+	/* the data blocks, one read per run of blocks in use */
+	for (i = 2 + sp_blk.isize; i < block_num; i += run) {
+		if (!used[i]) {
+			run = 1;
+			continue;
+		}
+		for (run = 1; run < AR_RUN_MAX && i + run < block_num && used[i + run]; run++) ;
+		pread(fs_fd, buf, run * BLOCK_SIZE, i * BLOCK_SIZE);
+		rec.type = AR_DATA;
+		rec.inum = 0;
+		rec.start = i;
+		rec.count = run;
+		fwrite(&rec, sizeof(rec), 1, out);
+		fwrite(buf, BLOCK_SIZE, run, out);
+		nblocks += run;
+	}
+	memset(&rec, 0, sizeof(rec));
+	rec.type = AR_END;
+	fwrite(&rec, sizeof(rec), 1, out);
+	fflush(out);
+
+	if (ferror(out))
+		fprintf(err_fp, "Error: failed on writing the archive!\n");
+	else
+		fprintf(out_fp, "export-archive command successfully executed, "
+			"%d files, %d blocks\n", nfiles, nblocks);
+	ret = ferror(out) ? -1 : 0;
+out:
+	if (ret < 0 && !ferror(out))
+		fprintf(err_fp, "Error: no memory for exporting the archive!\n");
+	free(ilist);
+	free(inds);
+	free(ind_data);
+	free(ind_slot);
+	free(used);
+	free(buf);
+	return ret;
+}
+
+/* write the run of blocks gathered in buf, *run of them starting at *start */
+static void flush_run(int fs_fd, char *buf, int *start, int *run)
+{
+	if (*run > 0)
+		pwrite(fs_fd, buf, *run * BLOCK_SIZE, *start * BLOCK_SIZE);
+	*run = 0;
+}
+
+/*
+ * replace the contents of the image with the archive read from in. the image
+ * is initialized with the geometry of the archive and the blocks are handed
+ * out from the bottom of the disk up as the file records come in, each
+ * indirect block followed by its data blocks, so every file ends up in one
+ * extent. the data that follows is written in runs of consecutive blocks.
+ * blocks files shared in the archived image stay shared
+ */
+static int import_archive(int fs_fd, FILE *in)
+{
+	struct archive_header hdr;
+	struct archive_rec rec;
+	struct inode nd;
+	unsigned short old[MAX_FILE_BLOCKS], indirect_block_data[ADDR_PER_BLOCK];
+	unsigned short *remap = NULL;
+	unsigned char *refs = NULL, *free_map = NULL;
+	char *buf = NULL, blk[BLOCK_SIZE];
+	int i, j, b, next, hole, start = 0, run = 0, ret = -1;
+	int nfiles = 0, nblocks = 0, shared = 0, listed = 0;
+
+	if (fread(&hdr, sizeof(hdr), 1, in) != 1 || memcmp(hdr.magic, "V6AR", 4) != 0 ||
+	    hdr.version != 1 || hdr.block_num > 65535 || hdr.inode_num > hdr.isize * 16 ||
+	    hdr.inode_num < 1 || hdr.block_num < 2 + (hdr.inode_num + 15) / 16 + 1) {	//room for the root's block
+		fprintf(err_fp, "Error: not a v6 archive!\n");
+		return -1;
+	}
+
+	initialized = 0;
+	block_num = hdr.block_num;
+	inode_num = hdr.inode_num;
+	if (init_v6fs(fs_fd) < 0)
+		return -1;
+	remap = calloc(block_num, sizeof(unsigned short));
+	refs = calloc(block_num, 1);
+	free_map = malloc(block_num);
+	buf = malloc(AR_RUN_MAX * BLOCK_SIZE);
+	if (remap == NULL || refs == NULL || free_map == NULL || buf == NULL) {
+		fprintf(err_fp, "Error: no memory for importing the archive!\n");
+		goto out;
+	}
+	next = 2 + sp_blk.isize;
+	memset(free_map, 0, next);
+	memset(free_map + next, 1, block_num - next);	//the root's block from initfs too
+
+	while (fread(&rec, sizeof(rec), 1, in) == 1 && rec.type == AR_INODE) {
+		if (rec.inum < 1 || rec.inum > inode_num || rec.count > MAX_FILE_BLOCKS ||
+		    fread(&nd, sizeof(nd), 1, in) != 1 ||
+		    fread(old, sizeof(unsigned short), rec.count, in) != rec.count)
+			goto damaged;
+		if (nd.flags & IS_INLINE) {
+			write_inode(fs_fd, rec.inum, &nd);
+			nfiles++;
+			continue;
+		}
+		memset(nd.addr, 0, sizeof(nd.addr));
+		if (rec.count <= 8)
+			nd.flags &= ~IS_LARGE;
+		else
+			nd.flags |= IS_LARGE;
+		for (i = 0; i * ADDR_PER_BLOCK < rec.count; i++) {
+			memset(indirect_block_data, 0, sizeof(indirect_block_data));
+			hole = 1;
+			for (j = i * ADDR_PER_BLOCK; j < rec.count && j < (i+1) * ADDR_PER_BLOCK; j++)
+				if (old[j] != 0)
+					hole = 0;
+			if (hole && (nd.flags & IS_LARGE))
+				continue;
+			if (nd.flags & IS_LARGE) {
+				if (next >= block_num)
+					goto full;
+				nd.addr[i] = next;
+				free_map[next++] = 0;
+			}
+			for (j = i * ADDR_PER_BLOCK; j < rec.count && j < (i+1) * ADDR_PER_BLOCK; j++) {
+				b = old[j];
+				if (b >= block_num)
+					goto damaged;
+				if (b != 0 && remap[b] != 0) {	//shared with an earlier file
+					refs[remap[b]] = refs[remap[b]] ? refs[remap[b]] + 1 : 2;
+					shared++;
+				} else if (b != 0) {
+					if (next >= block_num)
+						goto full;
+					remap[b] = next;
+					free_map[next++] = 0;
+				}
+				b = b ? remap[b] : 0;		//0 stays a hole
+				if (nd.flags & IS_LARGE)
+					indirect_block_data[j % ADDR_PER_BLOCK] = b;
+				else
+					nd.addr[j] = b;
+			}
+			if (nd.flags & IS_LARGE)
+				pwrite(fs_fd, indirect_block_data, BLOCK_SIZE, nd.addr[i] * BLOCK_SIZE);
+		}
+		write_inode(fs_fd, rec.inum, &nd);
+		nfiles++;
+	}
+	if (rec.type != AR_END_INODES)
+		goto damaged;
+
+	/* the rest of the disk is free, the free i-node array refills on demand */
+	rebuild_free_list(fs_fd, free_map);
+	listed = 1;
+	pthread_mutex_lock(&alloc_lock);
+	ninode = 0;
+	tinode = inode_num - nfiles;
+	pthread_mutex_unlock(&alloc_lock);
+	sp_blk.dedup = hdr.dedup;
+	sp_blk.compress = hdr.compress;
+	if ((hdr.dedup || shared) && create_dedup_table(fs_fd) < 0)
+		goto out;
+	pthread_mutex_lock(&alloc_lock);
+	for (i = 0; shared && i < block_num; i++)
+		if (refs[i] > 1)
+			set_blk_ref(i, refs[i]);
+	pthread_mutex_unlock(&alloc_lock);
+
+	while (fread(&rec, sizeof(rec), 1, in) == 1 && rec.type == AR_DATA) {
+		for (i = 0; i < rec.count; i++) {
+			if (fread(blk, BLOCK_SIZE, 1, in) != 1)
+				goto damaged;
+			b = rec.start + i;
+			if (b >= block_num || remap[b] == 0)
+				continue;
+			if (run == AR_RUN_MAX || (run > 0 && remap[b] != start + run))
+				flush_run(fs_fd, buf, &start, &run);
+			if (run == 0)
+				start = remap[b];
+			memcpy(buf + run++ * BLOCK_SIZE, blk, BLOCK_SIZE);
+			nblocks++;
+		}
+	}
+	flush_run(fs_fd, buf, &start, &run);
+	if (rec.type != AR_END)
+		goto damaged;
+
+	save_dedup_table(fs_fd);
+	update_super_block(fs_fd);
+	fprintf(out_fp, "import-archive command successfully executed, %d files, %d blocks\n",
+		nfiles, nblocks);
+	ret = 0;
+	goto out;
+full:
+	fprintf(err_fp, "Error: No blocks left!\n");
+	goto out;
+damaged:
+	flush_run(fs_fd, buf, &start, &run);
+	fprintf(err_fp, "Error: the archive is damaged or truncated!\n");
+out:
+	if (ret < 0 && free_map != NULL && !listed)
+		rebuild_free_list(fs_fd, free_map);	//keep what came in so far
+	if (ret < 0)
+		update_super_block(fs_fd);
+	free(remap);
+	free(refs);
+	free(free_map);
+	free(buf);
+	return ret;
+}
+
+/* export the image to, or import it from, the external file ext_file */
+static void archive_file(int fs_fd, int export, char *ext_file)
+{
+	FILE *ext;
+
+	ext = fopen(ext_file, export ? "w" : "r");
+	if (ext == NULL) {
+		fprintf(err_fp, "open file %s failed!\n", ext_file);
+		return;
+	}
+	if (export)
+		export_archive(fs_fd, ext);
+	else
+		import_archive(fs_fd, ext);
+	fclose(ext);
+}
+
+static int push_task(struct search_job *job, int id, int inum, char *path)
+{
+	struct task_deque *dq = &job->deques[id];
+	struct search_task *p;
+	int i, ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count == dq->cap) {
+		p = malloc((dq->cap * 2 + 64) * sizeof(*p));
+		if (p == NULL) {
+			ret = -1;
+		} else {
+			for (i = 0; i < dq->count; i++)
+				p[i] = dq->tasks[(dq->head + i) % dq->cap];
+			free(dq->tasks);
+			dq->tasks = p;
+			dq->head = 0;
+			dq->cap = dq->cap * 2 + 64;
+		}
+	}
+	if (ret == 0)
+		dq->tasks[(dq->head + dq->count++) % dq->cap] = (struct search_task){ inum, path };
+	pthread_mutex_unlock(&dq->lock);
+
+	if (ret == 0) {
+		pthread_mutex_lock(&job->wait_lock);
+		job->pending++;
+		job->queued++;
+		pthread_cond_signal(&job->wait_cond);
+		pthread_mutex_unlock(&job->wait_lock);
+	}
+	return ret;
+}
+
+/* take a task from the tail of deque id (own) or from its head (steal) */
+static int pop_task(struct search_job *job, int id, int steal, struct search_task *t)
+{
+	struct task_deque *dq = &job->deques[id];
+	int ret = 0;
+
+	pthread_mutex_lock(&dq->lock);
+	if (dq->count > 0) {
+		if (steal) {
+			*t = dq->tasks[dq->head];
+			dq->head = (dq->head + 1) % dq->cap;
+		} else {
+			*t = dq->tasks[(dq->head + dq->count - 1) % dq->cap];
+		}
+		dq->count--;
+		ret = 1;
+	}
+	pthread_mutex_unlock(&dq->lock);
+	return ret;
+}
+
+static void add_hit(struct search_job *job, char *path, unsigned int line, char *text)
+{
+	struct search_hit *p;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->nhits == job->hits_cap) {
+		p = realloc(job->hits, (job->hits_cap * 2 + 64) * sizeof(*p));
+		if (p == NULL) {
+			job->failed = 1;
+			pthread_mutex_unlock(&job->lock);
+			free(text);
+			return;
+		}
+		job->hits = p;
+		job->hits_cap = job->hits_cap * 2 + 64;
+	}
+	job->hits[job->nhits].path = strdup(path);
+	job->hits[job->nhits].line = line;
+	job->hits[job->nhits].text = text;
+	job->nhits++;
+	pthread_mutex_unlock(&job->lock);
+}
+
+static int cmp_hit(const void *a, const void *b)
+{
+	const struct search_hit *x = a, *y = b;
+	int c = strcmp(x->path, y->path);
+
+	if (c != 0)
+		return c;
+	return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/* first occurrence of pat (m bytes) in buf (n bytes), memchr does the skipping */
+static const char *find_pattern(const char *buf, int n, const char *pat, int m)
+{
+	const char *p = buf, *end = buf + n - m;
+
+	while (p <= end && (p = memchr(p, pat[0], end - p + 1)) != NULL) {
+		if (memcmp(p + 1, pat + 1, m - 1) == 0)
+			return p;
+		p++;
+	}
+	return NULL;
+}
+
+/* read len bytes of file gs->nd from pos, whichever way the file is stored */
+static void read_range(int fs_fd, struct grep_scan *gs, unsigned int pos, int len, char *out)
+{
+	if (gs->nd->flags & IS_INLINE)
+		memcpy(out, (char *)gs->nd->addr + pos, len);
+	else if (gs->nd->flags & IS_COMPRESSED)
+		read_compressed(fs_fd, gs->nd, gs->data, pos, len, (unsigned char *)out);
+	else
+		read_file_bytes(fs_fd, gs->data, pos, len, (unsigned char *)out);
+}
+
+/* move the line count of gs from p on to end */
+static void count_lines(struct grep_scan *gs, const char *p, const char *end)
+{
+	while (p < end && (p = memchr(p, '\n', end - p)) != NULL) {
+		p++;
+		gs->line++;
+		gs->line_pos = gs->buf_pos + (p - gs->buf);
+	}
+}
+
+/* record the line gs is at, it is read again if it is not all in the buffer */
+static void grep_hit(struct search_job *job, struct grep_scan *gs, char *path)
+{
+	char line_buf[GREP_LINE_MAX];
+	const char *start = NULL, *end;
+	char *text;
+	int i, len = 0;
+
+	if (gs->line_pos >= gs->buf_pos) {
+		start = gs->buf + (gs->line_pos - gs->buf_pos);
+		len = gs->buf + gs->total - start;
+	}
+	if (start == NULL || (len < GREP_LINE_MAX && memchr(start, '\n', len) == NULL &&
+			      gs->buf_pos + gs->total < gs->size)) {
+		len = gs->size - gs->line_pos;
+		if (len > GREP_LINE_MAX)
+			len = GREP_LINE_MAX;
+		read_range(job->fs_fd, gs, gs->line_pos, len, line_buf);
+		start = line_buf;
+	}
+	if (len > GREP_LINE_MAX)
+		len = GREP_LINE_MAX;
+	if ((end = memchr(start, '\n', len)) != NULL)
+		len = end - start;
+
+	text = malloc(strlen(path) + len + 16);
+	if (text == NULL) {
+		job->failed = 1;
+		return;
+	}
+	i = sprintf(text, "%s:%u:", path, gs->line);
+	memcpy(text + i, start, len);
+	for (; len > 0; len--, i++)
+		if ((unsigned char)text[i] < ' ' && text[i] != '\t')
+			text[i] = '.';
+	text[i] = '\0';
+	add_hit(job, path, gs->line, text);
+}
+
+/*
+ * search the contents of file nd a chunk at a time. the chunks are read
+ * straight into the search buffer, which keeps the last pattern_len - 1 bytes
+ * of the previous chunk for matches that cross into the next one. a line is
+ * reported once, at its first match
+ */
+static void grep_file(struct search_job *job, struct inode *nd, char *path)
+{
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	struct compress_header hdr;
+	struct grep_scan gs;
+	const char *m, *p, *nl, *tail;
+	unsigned int pos;
+	int n, nind, keep = 0, skip_line = 0;
+
+	get_file_blocks(job->fs_fd, nd, data, ind, &nind);
+	memset(&gs, 0, sizeof(gs));
+	gs.nd = nd;
+	gs.data = data;
+	gs.size = inode_file_size(nd);
+	gs.line = 1;
+	if (nd->flags & IS_COMPRESSED) {
+		if (read_compress_header(job->fs_fd, nd, data, &hdr) < 0)
+			return;
+		gs.size = hdr.size;
+	}
+	gs.buf = malloc(GREP_CHUNK + job->pattern_len);
+	if (gs.buf == NULL) {
+		job->failed = 1;
+		return;
+	}
+
+	for (pos = 0; pos < gs.size; pos += n) {
+		n = gs.size - pos < GREP_CHUNK ? gs.size - pos : GREP_CHUNK;
+		read_range(job->fs_fd, &gs, pos, n, gs.buf + keep);
+		gs.buf_pos = pos - keep;
+		gs.total = keep + n;
+
+		/* p is where the search goes on, lines are counted up to p */
+		p = gs.buf;
+		while (p < gs.buf + gs.total) {
+			if (skip_line) {
+				if ((nl = memchr(p, '\n', gs.buf + gs.total - p)) == NULL)
+					break;
+				count_lines(&gs, p, nl + 1);
+				p = nl + 1;
+				skip_line = 0;
+			}
+			m = find_pattern(p, gs.buf + gs.total - p, job->pattern, job->pattern_len);
+			if (m == NULL)
+				break;
+			count_lines(&gs, p, m);
+			grep_hit(job, &gs, path);
+			p = m;
+			skip_line = 1;
+		}
+
+		/* keep the tail a match could start in, its lines are counted next time */
+		keep = job->pattern_len - 1 < gs.total ? job->pattern_len - 1 : gs.total;
+		tail = gs.buf + gs.total - keep;
+		if (p < tail) {
+			if (!skip_line || memchr(p, '\n', tail - p) != NULL) {
+				count_lines(&gs, p, tail);
+				skip_line = 0;
+			}
+		} else {
+			keep = gs.buf + gs.total - p;	//nothing of it was looked at yet
+		}
+		memmove(gs.buf, gs.buf + gs.total - keep, keep);
+	}
+	free(gs.buf);
+}
+
+/* whether file nd called name is what find is looking for */
+static int find_match(struct search_job *job, struct inode *nd, char *name)
+{
+	unsigned short data[MAX_FILE_BLOCKS], ind[7];
+	struct compress_header hdr;
+	unsigned int size, units;
+	int nind;
+
+	if (job->name != NULL && fnmatch(job->name, name, 0) != 0)
+		return 0;
+	if (job->size_cmp == 2)
+		return 1;
+
+	size = inode_file_size(nd);
+	if (nd->flags & IS_COMPRESSED) {
+		get_file_blocks(job->fs_fd, nd, data, ind, &nind);
+		if (read_compress_header(job->fs_fd, nd, data, &hdr) == 0)
+			size = hdr.size;
+	}
+	units = (size + job->size_unit - 1) / job->size_unit;	//rounded up like find
+	if (job->size_cmp < 0)
+		return units < job->size;
+	if (job->size_cmp > 0)
+		return units > job->size;
+	return units == job->size;
+}
+
+/* look at one file or directory, the entries of a directory become new tasks */
+static void search_task(struct search_job *job, int id, struct search_task *t)
+{
+	struct inode nd;
+	struct dir_entry entries[DIR_ENTRY_MAX];
+	char *name, *child;
+	int i, n = 0;
 
+	lock_inode(t->inum, 0);
+	read_inode(job->fs_fd, t->inum, &nd);
+	name = strrchr(t->path, '/');
+	name = name && name[1] ? name + 1 : t->path;
+	if (!job->grep && find_match(job, &nd, name))
+		add_hit(job, t->path, 0, NULL);
+	if (nd.flags & IS_DIR)
+		n = read_dir(job->fs_fd, &nd, entries);
+	else if (job->grep && (nd.flags & INODE_ALLOC))
+		grep_file(job, &nd, t->path);
+	unlock_inode(t->inum);
 
-	/* create corresponding entry in current directory */
-	entry.i_num = inum;
-	strcpy(entry.name, v6_dir);
-	//printf("entry.i_num is %d, entry.name is %s\n", entry.i_num, entry.name);
-	lseek(fs_fd, 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
-	int entry_idx, block_idx;
-	if (nd.size1 % BLOCK_SIZE == 0) {
-		block_idx = get_free_block(fs_fd);
-		entry_idx = 0;
-		nd.addr[nd.size1 / BLOCK_SIZE] = block_idx;
-	} else {
-		block_idx = nd.addr[nd.size1 / BLOCK_SIZE];
-		entry_idx = (nd.size1 % BLOCK_SIZE) / sizeof(entry);
+	for (i = 0; i < n; i++) {
+		if (entries[i].i_num == 0 || is_dot_name(entries[i].name))
+			continue;
+		child = malloc(strlen(t->path) + sizeof(entries[i].name) + 2);
+		if (child == NULL) {
+			job->failed = 1;
+			continue;
+		}
+		sprintf(child, "%s%s%.14s", t->path,
+			t->path[strlen(t->path) - 1] == '/' ? "" : "/", entries[i].name);
+		if (push_task(job, id, entries[i].i_num, child) < 0) {
+			job->failed = 1;
+			free(child);
+		}
 	}
-	//printf("block_idx = %d, entry_idx = %d\n", block_idx, entry_idx);
-	lseek(fs_fd, block_idx * BLOCK_SIZE + entry_idx * sizeof(entry), SEEK_SET);
-	write(fs_fd, &entry, sizeof(entry));
+}
 
-	/* update contents of i-node representing current directory */
-	nd.size1 += sizeof(entry);
-	lseek(fs_fd, 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE, SEEK_SET);
-	write(fs_fd, &nd, sizeof(nd));
+/*
+ * a worker of the find/grep pool: it works through its own deque newest task
+ * first, and when that is empty steals the oldest task of another worker.
+ * with nothing to take it sleeps until a task is queued, and it stops once no
+ * task is queued or being worked on anywhere
+ */
+static void *search_worker(void *arg)
+{
+	struct search_job *job = arg;
+	struct search_task t;
+	int id, i, found, done;
 
+	id = __sync_fetch_and_add(&job->next_id, 1);
+	while (1) {
+		found = pop_task(job, id, 0, &t);
+		for (i = 1; !found && i < job->nworkers; i++)
+			found = pop_task(job, (id + i) % job->nworkers, 1, &t);
+		pthread_mutex_lock(&job->wait_lock);
+		if (found) {
+			job->queued--;
+		} else {
+			while (job->pending > 0 && job->queued == 0)
+				pthread_cond_wait(&job->wait_cond, &job->wait_lock);
+		}
+		done = job->pending == 0;
+		pthread_mutex_unlock(&job->wait_lock);
+		if (!found) {
+			if (done)
+				break;
+			continue;
+		}
 
-	return;
+		search_task(job, id, &t);
+		free(t.path);
+		pthread_mutex_lock(&job->wait_lock);
+		if (--job->pending == 0)
+			pthread_cond_broadcast(&job->wait_cond);
+		pthread_mutex_unlock(&job->wait_lock);
+	}
+	return NULL;
 }
 
-
-static void remove_file(int fs_fd, char *v6_file)
+/*
+ * print what find (grep == 0) or grep finds below path, walking the tree on a
+ * pool of workers. the results are sorted so the output does not depend on
+ * which worker got where first
+ */
+static void search_tree(int fs_fd, struct search_job *job, char *path)
 {
-	int inum, blk_idx;
-	int i, j, file_size; 
-	struct inode nd;
-	struct dir_entry entry;
+	int i, inum;
 
-	inum = locate_file(fs_fd, v6_file);
+	job->fs_fd = fs_fd;
+	inum = resolve_path(fs_fd, path);
 	if (inum < 0) {
-		printf("file %s does not exist in current directory, please check!\n", v6_file);
+		fprintf(out_fp, "%s does not exist, please check!\n", path);
 		return;
 	}
+	job->nworkers = worker_count(MAX_WORKERS);
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_mutex_init(&job->wait_lock, NULL);
+	pthread_cond_init(&job->wait_cond, NULL);
+	for (i = 0; i < job->nworkers; i++)
+		pthread_mutex_init(&job->deques[i].lock, NULL);
+	if (push_task(job, 0, inum, strdup(path)) == 0)
+		run_workers(search_worker, job, job->nworkers);
 
-
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
-	file_size = nd.size0 * (1 << 16) + nd.size1;
-	//printf("nd.size0 = %d, nd.size1 = %d, file_size = %d\n", nd.size0, nd.size1, file_size);
-	if ((nd.flags & IS_DIR) != 0) {
-		printf("currently delete a directory not supported\n");
-		return;
+	qsort(job->hits, job->nhits, sizeof(job->hits[0]), cmp_hit);
+	for (i = 0; i < job->nhits; i++) {
+		fprintf(out_fp, "%s\n", job->hits[i].text ? job->hits[i].text : job->hits[i].path);
+		free(job->hits[i].path);
+		free(job->hits[i].text);
 	}
-	if ((nd.flags & IS_LARGE) == 0) {		//small file
-		for (i = 0; i < (file_size / BLOCK_SIZE); i++) {
-			blk_idx = nd.addr[i];
-			add_free_block(fs_fd, blk_idx);
-		}
-		if ((file_size % BLOCK_SIZE) != 0) {
-			blk_idx = nd.addr[i];
-			add_free_block(fs_fd, blk_idx);
-		}
-	} else {					//large file
-		int total_block, j;
-		unsigned short indirect_block_data[256];
-		total_block = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-		for (i = 0; i < total_block / 256; i++) {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, indirect_block_data, BLOCK_SIZE);
-			for (j = 0; j < 256; j++) {
-				blk_idx = indirect_block_data[j];
-				add_free_block(fs_fd, blk_idx);
-			}
-			add_free_block(fs_fd, nd.addr[i]);
-		}
-		if (total_block % 256 != 0) {
-			blk_idx = nd.addr[i];
-			lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-			read(fs_fd, indirect_block_data, BLOCK_SIZE);
-			for (j = 0; j < (total_block % 256); j++) {
-				blk_idx = indirect_block_data[j];
-				add_free_block(fs_fd, blk_idx);
-			}
-			add_free_block(fs_fd, nd.addr[i]);
+	if (job->failed)
+		fprintf(err_fp, "Error: out of memory, the results are incomplete!\n");
+	free(job->hits);
+	for (i = 0; i < job->nworkers; i++) {
+		free(job->deques[i].tasks);
+		pthread_mutex_destroy(&job->deques[i].lock);
+	}
+	pthread_mutex_destroy(&job->lock);
+	pthread_mutex_destroy(&job->wait_lock);
+	pthread_cond_destroy(&job->wait_cond);
+}
+
+/*
+ * parse the arguments of find after the path: -name pattern and
+ * -size [+-]n[ck], n counts 512 byte blocks unless c (bytes) or k follows
+ */
+static int parse_find(struct search_job *job, char *token, char **save)
+{
+	char *end;
+
+	job->size_cmp = 2;
+	for (; token != NULL; token = strtok_r(NULL, " ", save)) {
+		if (strcmp(token, "-name") == 0) {
+			if ((job->name = strtok_r(NULL, " ", save)) == NULL)
+				return -1;
+		} else if (strcmp(token, "-size") == 0) {
+			if ((token = strtok_r(NULL, " ", save)) == NULL)
+				return -1;
+			job->size_cmp = *token == '+' ? 1 : *token == '-' ? -1 : 0;
+			if (*token == '+' || *token == '-')
+				token++;
+			job->size = strtoul(token, &end, 10);
+			job->size_unit = BLOCK_SIZE;
+			if (*end == 'c')
+				job->size_unit = 1;
+			else if (*end == 'k')
+				job->size_unit = 1024;
+			if (end == token || (*end != '\0' && end[1] != '\0') ||
+			    (*end != '\0' && *end != 'c' && *end != 'k'))
+				return -1;
+		} else {
+			return -1;
 		}
 	}
-	free_inode(fs_fd, inum);
+	return 0;
+}
+
+/* switch dedup mode, the dedup table is created the first time it is needed */
+static void dedup_mode(int fs_fd, int on)
+{
+	if (block_num == 0) {
+		fprintf(out_fp, "v6 file system has not been initialized yet\n");
+		return;
+	}
+	if (on && dedup_table == NULL && create_dedup_table(fs_fd) < 0)
+		return;
+	sp_blk.dedup = on;
+	fprintf(out_fp, "dedup mode %s\n", on ? "on" : "off");
+}
 
+static struct snapshot *find_snapshot(char *name)
+{
+	int i;
 
-	/* delete corresponding directory entry */
-	lseek(fs_fd, 2 * BLOCK_SIZE + (cur_dir_inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
+	if (snap_table == NULL)
+		return NULL;
+	for (i = 0; i < SNAP_MAX; i++)
+		if (snap_rec(i)->state != SNAP_FREE && strcmp(snap_rec(i)->name, name) == 0)
+			return snap_rec(i);
+	return NULL;
+}
 
-	for (i = 0; i < (nd.size1 / BLOCK_SIZE); i++) {
-		blk_idx = nd.addr[i];
-		lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-		for (j = 0; j < BLOCK_SIZE / sizeof(entry); j++) {
-			read(fs_fd, &entry, sizeof(entry));
-			if (strcmp(entry.name, v6_file) == 0)
-				goto rm_entry;
-		}
+/*
+ * freeze the current tree as snapshot name. nothing is copied here, the
+ * i-list blocks are copied out as the live tree changes them
+ */
+static void snapshot_create(int fs_fd, char *name)
+{
+	struct snapshot *snap = NULL;
+	int i, inum;
+
+	if (block_num == 0) {
+		fprintf(out_fp, "v6 file system has not been initialized yet\n");
+		return;
 	}
-	if ((nd.size1 % BLOCK_SIZE) != 0) {
-		blk_idx = nd.addr[i];
-		lseek(fs_fd, blk_idx * BLOCK_SIZE, SEEK_SET);
-		for (j = 0; j < (nd.size1 % BLOCK_SIZE) / sizeof(entry); j++) {
-			read(fs_fd, &entry, sizeof(entry));
-			if (strcmp(entry.name, v6_file) == 0)
-				goto rm_entry;
+	if (strlen(name) >= sizeof(snap->name)) {
+		fprintf(err_fp, "snapshot name %s is too long\n", name);
+		return;
+	}
+	if (find_snapshot(name) != NULL) {
+		fprintf(err_fp, "snapshot %s exists already\n", name);
+		return;
+	}
+
+	/* the block reference counts live in the dedup table */
+	if (dedup_table == NULL && create_dedup_table(fs_fd) < 0)
+		return;
+	if (snap_table == NULL) {
+		snap_rec_size = snap_record_size();
+		inum = create_hidden_file(fs_fd, SNAP_MAX * snap_rec_size);
+		if (inum < 0) {
+			fprintf(err_fp, "Error: no room for the snapshot table!\n");
+			return;
 		}
+		sp_blk.snap_inum = inum;
+		load_snap_table(fs_fd);
 	}
 
-rm_entry:
-	memset(&entry, 0, sizeof(entry));
-	lseek(fs_fd, -1 * sizeof(entry), SEEK_CUR);
-	write(fs_fd, &entry, sizeof(entry));
+	for (i = 0; i < SNAP_MAX && snap == NULL; i++)
+		if (snap_rec(i)->state == SNAP_FREE)
+			snap = snap_rec(i);
+	if (snap == NULL) {
+		fprintf(err_fp, "no more than %d snapshots, delete one first\n", SNAP_MAX);
+		return;
+	}
+	memset(snap, 0, snap_rec_size);
+	strcpy(snap->name, name);
+	snap->state = SNAP_OK;
+	snap->time = time(NULL);
+	snap_dirty = 1;
+	update_ilist_shared();
+	save_snap_table(fs_fd);
+	save_dedup_table(fs_fd);
+	update_super_block(fs_fd);
 
-	//need update inode(like file_size) of current directory and move back
-	//entries forward
+	fprintf(out_fp, "snapshot %s created\n", name);
+}
 
-	printf("command successfully executed, file %s has been deleted\n",v6_file);
-	return;
+static void snapshot_list(void)
+{
+	struct snapshot *snap;
+	char date[32];
+	time_t t;
+	int i, k, copied;
+
+	for (i = 0; snap_table != NULL && i < SNAP_MAX; i++) {
+		snap = snap_rec(i);
+		if (snap->state == SNAP_FREE)
+			continue;
+		t = snap->time;
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		for (k = 0, copied = 0; k < sp_blk.isize; k++)
+			if (snap->ilist[k] != 0)
+				copied++;
+		fprintf(out_fp, "%-14s%s  %d of %d i-list blocks copied%s\n", snap->name,
+			date, copied, sp_blk.isize,
+			snap->state == SNAP_DAMAGED ? ", damaged" : "");
+	}
 }
 
+/* delete snapshot name, its i-list copies go unless another snapshot has them */
+static void snapshot_delete(int fs_fd, char *name)
+{
+	struct snapshot *snap;
+	struct inode nd[16];
+	int i, j, k, blk_idx, kept;
+
+	if ((snap = find_snapshot(name)) == NULL) {
+		fprintf(err_fp, "snapshot %s does not exist\n", name);
+		return;
+	}
 
-static void access_dir(int fs_fd, char *v6_dir)
+	for (k = 0; k < sp_blk.isize; k++) {
+		if ((blk_idx = snap->ilist[k]) == 0)
+			continue;
+		for (i = 0, kept = 0; i < SNAP_MAX; i++)
+			if (snap_rec(i) != snap && snap_rec(i)->state != SNAP_FREE &&
+			    snap_rec(i)->ilist[k] == blk_idx)
+				kept = 1;
+		if (kept)
+			continue;
+		pread(fs_fd, nd, BLOCK_SIZE, blk_idx * BLOCK_SIZE);
+		for (j = 0; j < 16; j++)
+			drop_inode_refs(fs_fd, &nd[j]);
+		release_block(fs_fd, blk_idx);
+	}
+	memset(snap, 0, snap_rec_size);
+	snap_dirty = 1;
+	update_ilist_shared();
+	save_snap_table(fs_fd);
+	save_dedup_table(fs_fd);
+	update_super_block(fs_fd);
+
+	fprintf(out_fp, "snapshot %s deleted\n", name);
+}
+
+/*
+ * bring the live tree back to snapshot name: every i-list block the live tree
+ * changed since gets the snapshot's copy back. the snapshot is kept, so the
+ * same state can be rolled back to again
+ */
+static void rollback(int fs_fd, char *name)
 {
-	int inum;
-	char *dir_name;
+	struct snapshot *snap;
+	struct inode live[16], nd[16];
+	int j, k, inum, needed;
 
-	dir_name = strtok(v6_dir, "/");
-	//printf("dir_name is %s\n", dir_name);
-	inum = locate_file(fs_fd, dir_name);
-	if (inum < 0) {
-		printf("directory %s does not exist in current directory, please check!\n", v6_dir);
+	if ((snap = find_snapshot(name)) == NULL) {
+		fprintf(err_fp, "snapshot %s does not exist\n", name);
+		return;
+	}
+	if (snap->state != SNAP_OK) {
+		fprintf(err_fp, "snapshot %s is damaged, can't roll back to it\n", name);
 		return;
 	}
 
-	cur_dir_inum = inum;
+	/* other snapshots still sharing a block that changes need their copies */
+	for (k = 0, needed = 0; k < sp_blk.isize; k++)
+		if (snap->ilist[k] != 0 && ilist_shared[k])
+			needed++;
+	if (needed > tfree) {
+		fprintf(err_fp, "Error: No blocks left!\n");
+		return;
+	}
+
+	for (k = 0; k < sp_blk.isize; k++) {
+		if (snap->ilist[k] == 0)
+			continue;
+		pthread_mutex_lock(&snap_lock);
+		if (ilist_shared[k])
+			snap_copy_out(fs_fd, k);
+		pthread_mutex_unlock(&snap_lock);
+
+		pread(fs_fd, live, BLOCK_SIZE, (2 + k) * BLOCK_SIZE);
+		pread(fs_fd, nd, BLOCK_SIZE, snap->ilist[k] * BLOCK_SIZE);
+		for (j = 0; j < 16; j++) {
+			inum = k * 16 + j + 1;
+			if (inum > inode_num)
+				break;
+			if (is_hidden_inum(inum)) {
+				nd[j] = live[j];
+				continue;
+			}
+			/* take the new references before the old ones go */
+			pthread_mutex_lock(&alloc_lock);
+			take_inode_refs(&nd[j]);
+			if ((live[j].flags & INODE_ALLOC) && !(nd[j].flags & INODE_ALLOC))
+				tinode++;
+			else if (!(live[j].flags & INODE_ALLOC) && (nd[j].flags & INODE_ALLOC))
+				tinode--;
+			pthread_mutex_unlock(&alloc_lock);
+			drop_inode_refs(fs_fd, &live[j]);
+		}
+		pwrite(fs_fd, nd, BLOCK_SIZE, (2 + k) * BLOCK_SIZE);
+	}
+
+	/* cached free i-numbers and every session's current directory are stale */
+	pthread_mutex_lock(&alloc_lock);
+	ninode = 0;
+	pthread_mutex_unlock(&alloc_lock);
+	snap_gen++;
+	update_ilist_shared();
+	save_snap_table(fs_fd);
+	save_dedup_table(fs_fd);
+	update_super_block(fs_fd);
+
+	fprintf(out_fp, "rollback command successfully executed, back to snapshot %s\n", name);
 }
 
-/* check whether the file associated with inum is a directory file */
-static int is_dir(int fs_fd, int inum)
+
+/* parse and execute one command line, return 1 for q */
+static int exec_command(int fs_fd, char *cmd)
 {
-	struct inode nd;
+	char *bin_cmd, *token, *save;
+	char *ext_file, *v6_file, *v6_dir;
+	int nblk, ninod, recursive;
+	struct search_job job;
 
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
-	if ((nd.flags & IS_DIR) == 0)
+	//fprintf(out_fp, "The input command is %s\n", cmd);
+	bin_cmd = strtok_r(cmd, " ", &save);
+	if (bin_cmd == NULL)
 		return 0;
-	else
+	if (strcmp(bin_cmd, "initfs") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"initfs block_num inode_num\n");
+			return 0;
+		} else {
+			nblk = strtol(token, NULL, 0);
+		}
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"initfs block_num inode_num\n");
+			return 0;
+		} else {
+			ninod = strtol(token, NULL, 0);
+		}
+
+		//fprintf(out_fp, "block_num = %d, inode_num = %d\n", block_num, inode_num);
+		if (!initialized) {
+			block_num = nblk;
+			inode_num = ninod;
+		}
+		init_v6fs(fs_fd);
+	} else if (strcmp(bin_cmd, "cpin") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"cpin externalfile v6-file\n");
+			return 0;
+		} else {
+			ext_file = token;
+		}
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"cpin externalfile v6-file\n");
+			return 0;
+		} else {
+			v6_file = token;
+		}
+		//fprintf(out_fp, "ext_file = %s, v6_file = %s\n", ext_file, v6_file);
+		cpin(fs_fd, ext_file, v6_file);
+	} else if (strcmp(bin_cmd, "cpout") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"cpin externalfile v6-file\n");
+			return 0;
+		} else {
+			v6_file = token;
+		}
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"cpin externalfile v6-file\n");
+			return 0;
+		} else {
+			ext_file = token;
+		}
+		//fprintf(out_fp, "v6_file = %s, ext_file = %s\n", v6_file, ext_file);
+		cpout(fs_fd, v6_file, ext_file);
+	} else if (strcmp(bin_cmd, "mkdir") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"mkdir v6-dir\n");
+			return 0;
+		} else {
+			v6_dir = token;
+		}
+		//fprintf(out_fp, "v6_dir = %s\n", v6_dir);
+		make_dir(fs_fd, v6_dir);
+	} else if (strcmp(bin_cmd, "rm") == 0) {
+		recursive = 0;
+		token = strtok_r(NULL, " ", &save);
+		if (token != NULL && strcmp(token, "-r") == 0) {
+			recursive = 1;
+			token = strtok_r(NULL, " ", &save);
+		}
+		if (token == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"rm [-r] v6-file\n");
+			return 0;
+		} else {
+			v6_file = token;
+		}
+		//fprintf(out_fp, "v6_file = %s\n", v6_file);
+		remove_file(fs_fd, v6_file, recursive);
+	} else if (strcmp(bin_cmd, "cd") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"cd v6-dir\n");
+			return 0;
+		} else {
+			v6_dir = token;
+		}
+		//fprintf(out_fp, "v6_file = %s\n", v6_file);
+		access_dir(fs_fd, v6_dir);
+	} else if (strcmp(bin_cmd, "ls") == 0) {
+		list_files(fs_fd);
+	} else if (strcmp(bin_cmd, "du") == 0) {
+		v6_file = strtok_r(NULL, " ", &save);
+		disk_usage(fs_fd, v6_file);
+	} else if (strcmp(bin_cmd, "df") == 0) {
+		disk_free();
+	} else if (strcmp(bin_cmd, "defrag") == 0) {
+		v6_file = strtok_r(NULL, " ", &save);
+		defrag(fs_fd, v6_file);
+	} else if (strcmp(bin_cmd, "dedup") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL ||
+		    (strcmp(token, "on") != 0 && strcmp(token, "off") != 0)) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"dedup on|off\n");
+			return 0;
+		}
+		dedup_mode(fs_fd, strcmp(token, "on") == 0);
+	} else if (strcmp(bin_cmd, "compress") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL ||
+		    (strcmp(token, "on") != 0 && strcmp(token, "off") != 0)) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"compress on|off\n");
+			return 0;
+		}
+		sp_blk.compress = strcmp(token, "on") == 0;
+		fprintf(out_fp, "compress mode %s\n", sp_blk.compress ? "on" : "off");
+	} else if (strcmp(bin_cmd, "snapshot") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"snapshot name|list|delete name\n");
+			return 0;
+		}
+		if (strcmp(token, "list") == 0) {
+			snapshot_list();
+		} else if (strcmp(token, "delete") == 0) {
+			if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+				fprintf(err_fp, "Invalid parameter! should be: "
+					"snapshot delete name\n");
+				return 0;
+			}
+			snapshot_delete(fs_fd, token);
+		} else {
+			snapshot_create(fs_fd, token);
+		}
+	} else if (strcmp(bin_cmd, "rollback") == 0) {
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"rollback name\n");
+			return 0;
+		}
+		rollback(fs_fd, token);
+	} else if (strcmp(bin_cmd, "export-archive") == 0 ||
+		   strcmp(bin_cmd, "import-archive") == 0) {
+		if ((ext_file = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"%s externalfile\n", bin_cmd);
+			return 0;
+		}
+		archive_file(fs_fd, bin_cmd[0] == 'e', ext_file);
+	} else if (strcmp(bin_cmd, "find") == 0) {
+		memset(&job, 0, sizeof(job));
+		token = strtok_r(NULL, " ", &save);
+		v6_file = ".";
+		if (token != NULL && token[0] != '-') {
+			v6_file = token;
+			token = strtok_r(NULL, " ", &save);
+		}
+		if (parse_find(&job, token, &save) < 0) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"find [path] [-name pattern] [-size [+-]n[ck]]\n");
+			return 0;
+		}
+		search_tree(fs_fd, &job, v6_file);
+	} else if (strcmp(bin_cmd, "grep") == 0) {
+		memset(&job, 0, sizeof(job));
+		if ((token = strtok_r(NULL, " ", &save)) == NULL) {
+			fprintf(err_fp, "Invalid parameter! should be: "
+				"grep pattern [path]\n");
+			return 0;
+		}
+		job.grep = 1;
+		job.pattern = token;
+		job.pattern_len = strlen(token);
+		v6_file = strtok_r(NULL, " ", &save);
+		search_tree(fs_fd, &job, v6_file ? v6_file : ".");
+	} else if (strcmp(bin_cmd, "q") == 0) {
+		save_snap_table(fs_fd);
+		save_dedup_table(fs_fd);
+		update_super_block(fs_fd);
 		return 1;
+	} else {
+		fprintf(out_fp, "Invalid command!\n");
+		return 0;
+	}
+
+
+	return 0;
 }
 
-static void list_files(int fs_fd)
+/*
+ * run one command line under fs_lock, commands that work on the whole image
+ * take it exclusively
+ */
+static int run_command(int fs_fd, char *cmd)
 {
-	int inum, blk_idx;
-	int i, j;
-	struct inode nd;
-	struct dir_entry entry;
+	static const char *exclusive_cmds[] = { "initfs", "defrag", "dedup", "compress",
+						"snapshot", "rollback", "export-archive",
+						"import-archive", NULL };
+	int i, n, ret, gen, inum, exclusive = 0;
 
-	inum = cur_dir_inum;
-	lseek(fs_fd, 2 * BLOCK_SIZE + (inum-1) * INODE_SIZE, SEEK_SET);
-	read(fs_fd, &nd, sizeof(nd));
-	for (i = 0; i < (nd.size1 / BLOCK_SIZE); i++) {
-		blk_idx = nd.addr[i];
-		for (j = 0; j < BLOCK_SIZE / sizeof(entry); j++) {
-			lseek(fs_fd, blk_idx * BLOCK_SIZE + j * sizeof(entry), SEEK_SET);
-			read(fs_fd, &entry, sizeof(entry));
-			if (entry.i_num == 0)
-				continue;
-			printf("%s", entry.name);
-			if (is_dir(fs_fd, entry.i_num))
-				printf("/");
-			printf("    ");
+	n = strcspn(cmd, " ");
+	for (i = 0; exclusive_cmds[i] != NULL; i++)
+		if (n == strlen(exclusive_cmds[i]) && strncmp(cmd, exclusive_cmds[i], n) == 0)
+			exclusive = 1;
+
+	if (exclusive)
+		pthread_rwlock_wrlock(&fs_lock);
+	else
+		pthread_rwlock_rdlock(&fs_lock);
+	if (cwd_gen != snap_gen) {		//a rollback may have removed it
+		cwd_gen = snap_gen;
+		cur_dir_inum = ROOT_INUM;
+	}
+	gen = __sync_fetch_and_add(&rm_gen, 0);
+	if (cwd_rm_gen != gen) {		//an rm -r may have removed it
+		cwd_rm_gen = gen;
+		inum = cur_dir_inum;
+		lock_inode(inum, 0);
+		if (!cur_dir_exists(fs_fd)) {
+			fprintf(err_fp, "the current directory has been removed, back to the root directory\n");
+			cur_dir_inum = ROOT_INUM;
 		}
+		unlock_inode(inum);
 	}
-	if ((nd.size1 % BLOCK_SIZE) != 0) {
-		blk_idx = nd.addr[i];
-		for (j = 0; j < (nd.size1 % BLOCK_SIZE) / sizeof(entry); j++) {
-			lseek(fs_fd, blk_idx * BLOCK_SIZE + j * sizeof(entry), SEEK_SET);
-			read(fs_fd, &entry, sizeof(entry));
-			if (entry.i_num == 0)
-				continue;
-			printf("%s", entry.name);
-			if (is_dir(fs_fd, entry.i_num))
-				printf("/");
-			printf("    ");
+	ret = exec_command(fs_fd, cmd);
+	pthread_rwlock_unlock(&fs_lock);
+	return ret;
+}
+
+static volatile sig_atomic_t server_stop = 0;
+
+static void stop_server(int sig)
+{
+	server_stop = 1;
+}
+
+struct client {
+	int fs_fd;
+	int fd;
+};
+
+/* serve the commands of one client, each client has its own current directory */
+static void *client_thread(void *arg)
+{
+	struct client *c = arg;
+	char cmd[256];
+	FILE *in;
+
+	in = fdopen(c->fd, "r");
+	out_fp = fdopen(dup(c->fd), "w");
+	err_fp = out_fp;
+	cur_dir_inum = ROOT_INUM;
+	if (in == NULL || out_fp == NULL)
+		goto out;
+
+	while (1) {
+		fprintf(out_fp, "V6FS> ");
+		fflush(out_fp);
+		if (fgets(cmd, sizeof(cmd), in) == NULL)
+			break;
+		cmd[strcspn(cmd, "\r\n")] = '\0';
+		if (cmd[0] == '\0')
+			continue;
+		if (run_command(c->fs_fd, cmd))
+			break;
+	}
+
+out:
+	if (out_fp != NULL)
+		fclose(out_fp);
+	if (in != NULL)
+		fclose(in);
+	else
+		close(c->fd);
+	free(c);
+	return NULL;
+}
+
+/*
+ * serve the image to any number of clients on a unix socket until SIGINT or
+ * SIGTERM arrives, then save the super block and quit
+ */
+static void serve(int fs_fd, char *sock_path)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct client *c;
+	pthread_t tid;
+	int sfd, cfd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+	unlink(sock_path);
+	sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sfd < 0 || bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(sfd, 16) < 0) {
+		fprintf(stderr, "Listen on %s failed: %d, %s\n",
+			sock_path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_server;		//no SA_RESTART, accept must return
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	printf("serving v6 file system on %s\n", sock_path);
+	fflush(stdout);
+
+	while (!server_stop) {
+		cfd = accept(sfd, NULL, NULL);
+		if (cfd < 0)
+			continue;
+		c = malloc(sizeof(*c));
+		if (c == NULL) {
+			close(cfd);
+			continue;
+		}
+		c->fs_fd = fs_fd;
+		c->fd = cfd;
+		if (pthread_create(&tid, NULL, client_thread, c) != 0) {
+			close(cfd);
+			free(c);
+			continue;
 		}
+		pthread_detach(tid);
 	}
 
-	printf("\n");
+	close(sfd);
+	unlink(sock_path);
+	pthread_rwlock_wrlock(&fs_lock);	//wait for running commands
+	save_snap_table(fs_fd);
+	save_dedup_table(fs_fd);
+	update_super_block(fs_fd);
+	printf("server stopped\n");
+	exit(0);
 }
 
 
@@ -760,13 +4159,15 @@ int main(int argc, char **argv)
 {
 	int fs_fd;
 	char cmd[256];
-	char *bin_cmd, *token;
-	char *ext_file, *v6_file, *v6_dir;
-	//int block_num, inode_num;
 
-	if (argc < 2) {
+	if (argc < 2 || (argc == 3 && strcmp(argv[2], "-e") != 0 && strcmp(argv[2], "-i") != 0) ||
+	    (argc > 3 && (argc != 4 || strcmp(argv[2], "-s") != 0))) {
 		fprintf(stderr, "Invalid argument number: need a parameter "
-			"to identify the path of file system image\n");
+			"to identify the path of file system image\n"
+			"usage: %s v6-image [-s socket-path | -e | -i]\n"
+			"  -e writes an archive of the image to standard output,\n"
+			"  -i replaces the image with an archive from standard input\n",
+			argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -777,124 +4178,39 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	print_usage();
+	out_fp = stdout;
+	err_fp = stderr;
 	read_super_block(fs_fd);
+	load_dedup_table(fs_fd);
+	load_snap_table(fs_fd);
+	if (sp_blk.isize != 0 && !sp_blk.usage)
+		recount_usage(fs_fd);
+	init_inode_locks();
+	if (argc == 4)
+		serve(fs_fd, argv[3]);
+	if (argc == 3) {
+		out_fp = stderr;		//standard output may carry the archive
+		if (strcmp(argv[2], "-e") == 0)
+			exit(export_archive(fs_fd, stdout) < 0 ? EXIT_FAILURE : 0);
+		exit(import_archive(fs_fd, stdin) < 0 ? EXIT_FAILURE : 0);
+	}
 
+	print_usage();
 	while (1) {
 		printf("V6FS> ");
 		cmd[0] = '\n';
-		scanf("%[^\n]", cmd);
+		if (scanf("%[^\n]", cmd) == EOF)
+			strcpy(cmd, "q");		//end of input saves like q
 		/* in case user just typed \n */
 		if (cmd[0] == '\n') {
 			flush_std_input();
 			continue;
 		}
-		//printf("The input command is %s\n", cmd);
-		bin_cmd = strtok(cmd, " ");
-		if (strcmp(bin_cmd, "initfs") == 0) {
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"initfs block_num inode_num\n");
-				flush_std_input();
-				continue;
-			} else {
-				block_num = strtol(token, NULL, 0);
-			}
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"initfs block_num inode_num\n");
-				flush_std_input();
-				continue;
-			} else {
-				inode_num = strtol(token, NULL, 0);
-			}
-
-			//printf("block_num = %d, inode_num = %d\n", block_num, inode_num);
-			init_v6fs(fs_fd);
-		} else if (strcmp(bin_cmd, "cpin") == 0) {
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"cpin externalfile v6-file\n");
-				flush_std_input();
-				continue;
-			} else {
-				ext_file = token;
-			}
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"cpin externalfile v6-file\n");
-				flush_std_input();
-				continue;
-			} else {
-				v6_file = token;
-			}
-			//printf("ext_file = %s, v6_file = %s\n", ext_file, v6_file);
-			cpin(fs_fd, ext_file, v6_file);
-		} else if (strcmp(bin_cmd, "cpout") == 0) {
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"cpin externalfile v6-file\n");
-				flush_std_input();
-				continue;
-			} else {
-				v6_file = token;
-			}
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"cpin externalfile v6-file\n");
-				flush_std_input();
-				continue;
-			} else {
-				ext_file = token;
-			}
-			//printf("v6_file = %s, ext_file = %s\n", v6_file, ext_file);
-			cpout(fs_fd, v6_file, ext_file);
-		} else if (strcmp(bin_cmd, "mkdir") == 0) {
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"mkdir v6-dir\n");
-				flush_std_input();
-				continue;
-			} else {
-				v6_dir = token;
-			}
-			//printf("v6_dir = %s\n", v6_dir);
-			make_dir(fs_fd, v6_dir);
-		} else if (strcmp(bin_cmd, "rm") == 0) {
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"rm v6-file\n");
-				flush_std_input();
-				continue;
-			} else {
-				v6_file = token;
-			}
-			//printf("v6_file = %s\n", v6_file);
-			remove_file(fs_fd, v6_file);
-		} else if (strcmp(bin_cmd, "cd") == 0) {
-			if ((token = strtok(NULL, " ")) == NULL) {
-				fprintf(stderr, "Invalid parameter! should be: "
-					"cd v6-dir\n");
-				flush_std_input();
-				continue;
-			} else {
-				v6_dir = token;
-			}
-			//printf("v6_file = %s\n", v6_file);
-			access_dir(fs_fd, v6_dir);
-		} else if (strcmp(bin_cmd, "ls") == 0) {
-			list_files(fs_fd);
-		} else if (strcmp(bin_cmd, "q") == 0) {
-			update_super_block(fs_fd);
+		if (run_command(fs_fd, cmd)) {
 			printf("quit now!\n");
 			exit(0);
-		} else {
-			printf("Invalid command!\n");
-			flush_std_input();
-			continue;
 		}
 
 		flush_std_input();
 	}
 }
-